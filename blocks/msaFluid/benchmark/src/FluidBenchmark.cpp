@@ -0,0 +1,555 @@
+/***********************************************************************
+
+ Headless benchmark of ciMsaFluidSolver. Runs the solver on a scripted
+ stir for every combination of the given grid sizes, solver iterations,
+ RGB, vorticity and wrap settings and prints one CSV row per combination.
+ It doubles as the regression test of the solver: --record saves the
+ fields after the last step as golden snapshots, --verify compares a run
+ against them and exits with 1 if any combination is off.
+
+ usage: FluidBenchmark [options]
+	--sizes 64x48,128x96,...	grid sizes (default 128x96)
+	--iterations 10,20,...		linear solver iterations (default 10)
+	--rgb 0,1					monochrome / RGB color (default 0)
+	--vorticity 0,1				vorticity confinement off / on (default 0)
+	--wrap 0,1,2,3				wrap none, x, y or both (default 2)
+	--steps n					timed updates per combination (default 500)
+	--warmup n					untimed updates before timing (default 50)
+	--method gs|rb				gauss-seidel or red-black solver (default rb)
+	--projection relax|mg		relaxation or multigrid pressure (default relax)
+	--advection sl|mc			semi-lagrangian or maccormack advection (default sl)
+	--threads n					solver threads, 0 uses all cores (default 1)
+	--simd 0|1					simd inner loops (default 1)
+	--tiles 0|1					active tile tracking (default 0)
+	--blocking 0|1				cache blocked relaxation (default 0)
+	--stats 0|1					density and speed stats (default 1)
+	--fixed 0|1					16 bit fixed point color (default 0)
+	--splats n					stir with n splats a step instead (default 0)
+	--stir n					stir the first n steps only and let the fluid
+								decay after (default all steps)
+	--ftz 0|1					flush denormals to zero (default 1)
+	--record dir				save the fields of each combination to dir
+	--verify dir				compare the fields of each combination to dir
+	--tolerance t				largest difference of a field relative to its
+								largest magnitude in the snapshot (default 1e-4)
+	--report file				write the CSV to file as well
+
+ the ns_per_cell columns are nanoseconds per interior grid cell, for a
+ whole update and for each call of a stage. ms_p99 and ms_max are the
+ 99th percentile and the slowest of the timed steps, where the spikes of
+ a decaying fluid show up: --stir 50 --steps 2000 --ftz 0 against --ftz 1. checksum sums the absolute
+ velocity and color over the grid after the last step. with fixed point
+ color an untimed float solver runs the same stir alongside and the
+ color_error columns are the rms and largest difference of their color
+ components after the last step, zero otherwise. memory_bytes is what
+ the solver holds after the last step
+
+ a snapshot holds u, v and the color of every cell, boundary included.
+ it is named after the settings that change the result: size,
+ iterations, rgb, vorticity, wrap, method, projection, advection, fixed,
+ splats, stir and the number of steps. threads, ftz, simd, tiles, blocking and
+ stats leave it alone, so a snapshot recorded with the reference modes
+ checks all of them. golden is recorded, ok, fail or missing, and
+ golden_error the largest relative difference of the fields. a suite
+ covering the settings of the app and their neighbours:
+
+	FluidBenchmark --sizes 64x48 --iterations 5,10,20 --rgb 0,1 --vorticity 0,1
+				   --wrap 0,1,2,3 --steps 100 --simd 0 --record golden
+	FluidBenchmark ... --simd 1 --threads 4 --blocking 1 --verify golden
+	FluidBenchmark ... --tiles 1 --verify golden
+
+ simd, threads, blocking and stats give the same result to the bit. active
+ tiles differ in the last bits, well within the tolerance. with vorticity
+ confinement on the solver updates the full grid and ignores the tiles: it
+ normalizes the gradient of the curl, which would turn any difference into
+ one of the size of the force within a few dozen steps
+
+ benchmark/golden holds snapshots recorded from the original solver at 64x48 with
+ the default settings and vorticity off, vorticity is too chaotic to survive
+ libm differences. scons fluid-verify runs
+
+	FluidBenchmark --sizes 64x48 --rgb 0,1 --wrap 0,2 --method gs --steps 100
+				   --tolerance 1e-3 --verify golden
+
+ with the reference modes and again with simd, threads and tiles on
+
+ ***********************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ciMsaFluidSolver.h"
+
+using namespace ci;
+using namespace std;
+
+struct Settings
+{
+	vector< Vec2i > sizes;
+	vector< int > iterations;
+	vector< int > rgb;
+	vector< int > vorticity;
+	vector< int > wrap;
+	int steps;
+	int warmup;
+	bool redBlack;
+	bool multigrid;
+	bool maccormack;
+	int threads;
+	bool simd;
+	bool tiles;
+	bool blocking;
+	bool stats;
+	bool fixed;
+	int splats;
+	int stir;
+	bool ftz;
+	string record;
+	string verify;
+	double tolerance;
+	string report;
+};
+
+static FILE *sReport = NULL;
+
+// prints to stdout and to the report
+static void output( const char *format, ... )
+{
+	va_list args;
+	va_start( args, format );
+	vprintf( format, args );
+	va_end( args );
+	if ( sReport )
+	{
+		va_start( args, format );
+		vfprintf( sReport, format, args );
+		va_end( args );
+	}
+}
+
+static vector< int > parseInts( const char *arg )
+{
+	vector< int > values;
+	for ( const char *s = arg; *s; )
+	{
+		char *end;
+		values.push_back( (int)strtol( s, &end, 10 ) );
+		if ( end == s )
+			break;
+		s = ( *end == ',' ) ? end + 1 : end;
+	}
+	return values;
+}
+
+static vector< Vec2i > parseSizes( const char *arg )
+{
+	vector< Vec2i > sizes;
+	for ( const char *s = arg; *s; )
+	{
+		int x, y, n;
+		if ( sscanf( s, "%dx%d%n", &x, &y, &n ) != 2 )
+			break;
+		sizes.push_back( Vec2i( x, y ) );
+		s += n;
+		if ( *s == ',' )
+			s++;
+	}
+	return sizes;
+}
+
+static void usage()
+{
+	fprintf( stderr, "usage: FluidBenchmark [--sizes WxH,...] [--iterations n,...] [--rgb 0,1] [--vorticity 0,1]\n"
+					 "                      [--wrap 0,1,2,3] [--steps n] [--warmup n] [--method gs|rb]\n"
+					 "                      [--projection relax|mg] [--advection sl|mc] [--threads n] [--simd 0|1]\n"
+					 "                      [--tiles 0|1] [--blocking 0|1] [--stats 0|1] [--fixed 0|1]\n"
+					 "                      [--splats n] [--stir n] [--ftz 0|1] [--record dir | --verify dir]\n"
+					 "                      [--tolerance t] [--report file]\n" );
+	exit( 1 );
+}
+
+static bool parseArgs( int argc, char **argv, Settings *settings )
+{
+	settings->sizes.push_back( Vec2i( 128, 96 ) );
+	settings->iterations.push_back( FLUID_DEFAULT_SOLVER_ITERATIONS );
+	settings->rgb.push_back( 0 );
+	settings->vorticity.push_back( 0 );
+	settings->wrap.push_back( 2 );
+	settings->steps = 500;
+	settings->warmup = 50;
+	settings->redBlack = true;
+	settings->multigrid = false;
+	settings->maccormack = false;
+	settings->threads = 1;
+	settings->simd = true;
+	settings->tiles = false;
+	settings->blocking = false;
+	settings->stats = true;
+	settings->fixed = false;
+	settings->splats = 0;
+	settings->stir = -1;
+	settings->ftz = true;
+	settings->tolerance = 1e-4;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( i + 1 >= argc )
+			return false;
+		const char *opt = argv[ i ];
+		const char *arg = argv[ ++i ];
+		if ( !strcmp( opt, "--sizes" ) )
+			settings->sizes = parseSizes( arg );
+		else if ( !strcmp( opt, "--iterations" ) )
+			settings->iterations = parseInts( arg );
+		else if ( !strcmp( opt, "--rgb" ) )
+			settings->rgb = parseInts( arg );
+		else if ( !strcmp( opt, "--vorticity" ) )
+			settings->vorticity = parseInts( arg );
+		else if ( !strcmp( opt, "--wrap" ) )
+			settings->wrap = parseInts( arg );
+		else if ( !strcmp( opt, "--steps" ) )
+			settings->steps = atoi( arg );
+		else if ( !strcmp( opt, "--warmup" ) )
+			settings->warmup = atoi( arg );
+		else if ( !strcmp( opt, "--method" ) )
+			settings->redBlack = strcmp( arg, "gs" ) != 0;
+		else if ( !strcmp( opt, "--projection" ) )
+			settings->multigrid = !strcmp( arg, "mg" );
+		else if ( !strcmp( opt, "--advection" ) )
+			settings->maccormack = !strcmp( arg, "mc" );
+		else if ( !strcmp( opt, "--threads" ) )
+			settings->threads = atoi( arg );
+		else if ( !strcmp( opt, "--simd" ) )
+			settings->simd = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--tiles" ) )
+			settings->tiles = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--blocking" ) )
+			settings->blocking = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--stats" ) )
+			settings->stats = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--fixed" ) )
+			settings->fixed = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--splats" ) )
+			settings->splats = atoi( arg );
+		else if ( !strcmp( opt, "--stir" ) )
+			settings->stir = atoi( arg );
+		else if ( !strcmp( opt, "--ftz" ) )
+			settings->ftz = atoi( arg ) != 0;
+		else if ( !strcmp( opt, "--record" ) )
+			settings->record = arg;
+		else if ( !strcmp( opt, "--verify" ) )
+			settings->verify = arg;
+		else if ( !strcmp( opt, "--tolerance" ) )
+			settings->tolerance = atof( arg );
+		else if ( !strcmp( opt, "--report" ) )
+			settings->report = arg;
+		else
+			return false;
+	}
+
+	return !settings->sizes.empty() && !settings->iterations.empty() &&
+		!settings->rgb.empty() && !settings->vorticity.empty() && !settings->wrap.empty() &&
+		settings->steps > 0 && ( settings->record.empty() || settings->verify.empty() );
+}
+
+// four emitters circling the middle of the grid, the same on every run
+static void stir( ciMsaFluidSolver &solver, const Settings &settings, int step )
+{
+	if ( settings.stir >= 0 && step >= settings.stir )
+		return;
+
+	int splats = settings.splats;
+	float t = step * 0.05f;
+	if ( splats > 0 )
+	{
+		// the same circling spread over more emitters, queued as one batch of splats
+		vector< ciMsaFluidSolver::Splat > batch( splats );
+		for ( int k = 0; k < splats; k++ )
+		{
+			float phase = k * 6.2832f / splats;
+			batch[ k ].pos = Vec2f( .5f + .3f * cos( t + phase ), .5f + .3f * sin( t * 1.3f + phase ) );
+			batch[ k ].force = Vec2f( .3f * cos( t * 2 + phase ), .3f * sin( t * 2 + phase ) );
+			batch[ k ].color = Color( 1, .5f, .2f );
+			batch[ k ].radius = .02f;
+		}
+		solver.addSplats( batch.data(), splats );
+		return;
+	}
+
+	for ( int k = 0; k < 4; k++ )
+	{
+		Vec2f pos( .5f + .3f * cos( t + k * 1.57f ), .5f + .3f * sin( t * 1.3f + k ) );
+		Vec2f force( .3f * cos( t * 2 + k ), .3f * sin( t * 2 + k ) );
+		solver.addForceAtPos( pos, force );
+		solver.addColorAtPos( pos.x, pos.y, 1, .5f, .2f );
+	}
+}
+
+static double checksum( const ciMsaFluidSolver &solver )
+{
+	double sum = 0;
+	for ( int j = 0; j < solver.getHeight(); j++ )
+	{
+		for ( int i = 0; i < solver.getWidth(); i++ )
+		{
+			Vec2f vel;
+			Color color;
+			solver.getInfoAtCell( i, j, &vel, &color );
+			sum += fabs( vel.x ) + fabs( vel.y ) + color.r + color.g + color.b;
+		}
+	}
+	return sum;
+}
+
+// largest and rms difference of the color components of two solvers of the same size
+static void colorError( const ciMsaFluidSolver &solver, const ciMsaFluidSolver &reference, double *rms, double *maxError )
+{
+	double sumSq = 0;
+	*maxError = 0;
+	for ( int j = 0; j < solver.getHeight(); j++ )
+	{
+		for ( int i = 0; i < solver.getWidth(); i++ )
+		{
+			Color color, expected;
+			solver.getInfoAtCell( i, j, NULL, &color );
+			reference.getInfoAtCell( i, j, NULL, &expected );
+			float error[ 3 ] = { color.r - expected.r, color.g - expected.g, color.b - expected.b };
+			for ( int c = 0; c < 3; c++ )
+			{
+				sumSq += error[ c ] * error[ c ];
+				*maxError = max( *maxError, (double)fabs( error[ c ] ) );
+			}
+		}
+	}
+	*rms = sqrt( sumSq / ( 3. * solver.getWidth() * solver.getHeight() ) );
+}
+
+// u, v, r, g and b of every cell, boundary included
+static vector< float > snapshot( const ciMsaFluidSolver &solver )
+{
+	int cells = solver.getWidth() * solver.getHeight();
+	vector< float > fields( 5 * cells );
+	for ( int j = 0; j < solver.getHeight(); j++ )
+	{
+		for ( int i = 0; i < solver.getWidth(); i++ )
+		{
+			Vec2f vel;
+			Color color;
+			solver.getInfoAtCell( i, j, &vel, &color );
+			int k = i + j * solver.getWidth();
+			fields[ k ] = vel.x;
+			fields[ cells + k ] = vel.y;
+			fields[ 2 * cells + k ] = color.r;
+			fields[ 3 * cells + k ] = color.g;
+			fields[ 4 * cells + k ] = color.b;
+		}
+	}
+	return fields;
+}
+
+static string snapshotPath( const string &dir, const Settings &settings, Vec2i size, int iterations, bool rgb, bool vorticity, int wrap )
+{
+	char name[ 256 ], stirred[ 32 ] = "";
+	// stirring all the way through keeps the names from before --stir
+	if ( settings.stir >= 0 )
+		snprintf( stirred, sizeof( stirred ), "_t%d", settings.stir );
+	snprintf( name, sizeof( name ), "/%dx%d_i%d_rgb%d_v%d_w%d_%s_%s_%s_f%d_s%d%s_n%d.golden", size.x, size.y, iterations, rgb, vorticity, wrap,
+			  settings.redBlack ? "rb" : "gs", settings.multigrid ? "mg" : "relax", settings.maccormack ? "mc" : "sl",
+			  settings.fixed, settings.splats, stirred, settings.warmup + settings.steps );
+	return dir + name;
+}
+
+static bool writeSnapshot( const string &path, const vector< float > &fields )
+{
+	FILE *file = fopen( path.c_str(), "wb" );
+	if ( !file )
+		return false;
+	bool written = fwrite( &fields[ 0 ], sizeof( float ), fields.size(), file ) == fields.size();
+	return ( fclose( file ) == 0 ) && written;
+}
+
+static bool readSnapshot( const string &path, vector< float > *fields )
+{
+	FILE *file = fopen( path.c_str(), "rb" );
+	if ( !file )
+		return false;
+	bool read = fread( &( *fields )[ 0 ], sizeof( float ), fields->size(), file ) == fields->size() && fgetc( file ) == EOF;
+	fclose( file );
+	return read;
+}
+
+// largest difference of each field relative to the largest magnitude of the field in the snapshot, the largest of the fields
+static double snapshotError( const vector< float > &fields, const vector< float > &golden )
+{
+	size_t cells = fields.size() / 5;
+	double error = 0;
+	for ( size_t f = 0; f < 5; f++ )
+	{
+		double scale = 0, diff = 0;
+		for ( size_t k = f * cells; k < ( f + 1 ) * cells; k++ )
+		{
+			scale = max( scale, (double)fabs( golden[ k ] ) );
+			diff = max( diff, (double)fabs( fields[ k ] - golden[ k ] ) );
+		}
+		// a field that is zero in the snapshot has to stay exactly that
+		if ( diff > 0 )
+			error = max( error, scale > 0 ? diff / scale : HUGE_VAL );
+	}
+	return error;
+}
+
+static void setup( ciMsaFluidSolver &solver, const Settings &settings, Vec2i size, int iterations, bool rgb, bool vorticity, int wrap )
+{
+	solver.setup( size.x, size.y );
+	solver.enableRGB( rgb ).setFadeSpeed( 0.002f ).setDeltaT( .5f ).setVisc( 0.00015f ).setColorDiffusion( 0 );
+	solver.setWrap( ( wrap & 1 ) != 0, ( wrap & 2 ) != 0 );
+	solver.enableVorticityConfinement( vorticity );
+	solver.setSolverIterations( iterations );
+	solver.setSolverMethod( settings.redBlack ? ciMsaFluidSolver::SOLVER_RED_BLACK : ciMsaFluidSolver::SOLVER_GAUSS_SEIDEL );
+	solver.setProjectionMethod( settings.multigrid ? ciMsaFluidSolver::PROJECTION_MULTIGRID : ciMsaFluidSolver::PROJECTION_RELAXATION );
+	solver.setAdvectionMethod( settings.maccormack ? ciMsaFluidSolver::ADVECTION_MACCORMACK : ciMsaFluidSolver::ADVECTION_SEMI_LAGRANGIAN );
+	solver.setNumThreads( settings.threads );
+	solver.enableSimd( settings.simd );
+	solver.enableActiveTiles( settings.tiles );
+	solver.enableCacheBlocking( settings.blocking );
+	solver.enableStats( settings.stats );
+	solver.enableDenormalFlush( settings.ftz );
+}
+
+// returns false if the run does not match its snapshot
+static bool run( const Settings &settings, Vec2i size, int iterations, bool rgb, bool vorticity, int wrap )
+{
+	ciMsaFluidSolver solver;
+	setup( solver, settings, size, iterations, rgb, vorticity, wrap );
+	solver.enableFixedColor( settings.fixed );
+
+	ciMsaFluidSolver reference;
+	if ( settings.fixed )
+		setup( reference, settings, size, iterations, rgb, vorticity, wrap );
+
+	for ( int step = 0; step < settings.warmup; step++ )
+	{
+		stir( solver, settings, step );
+		solver.update();
+		if ( settings.fixed )
+		{
+			stir( reference, settings, step );
+			reference.update();
+		}
+	}
+
+	solver.enableStageTimes( true );
+	solver.resetStageTimes();
+	double total = 0;
+	vector< double > stepTimes;
+	stepTimes.reserve( settings.steps );
+	for ( int step = settings.warmup; step < settings.warmup + settings.steps; step++ )
+	{
+		stir( solver, settings, step );
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		solver.update();
+		double seconds = chrono::duration< double >( chrono::steady_clock::now() - start ).count();
+		total += seconds;
+		stepTimes.push_back( seconds );
+		if ( settings.fixed )
+		{
+			stir( reference, settings, step );
+			reference.update();
+		}
+	}
+
+	double rms = 0, maxError = 0;
+	if ( settings.fixed )
+		colorError( solver, reference, &rms, &maxError );
+
+	const char *golden = "";
+	double goldenError = 0;
+	bool passed = true;
+	if ( !settings.record.empty() )
+	{
+		string path = snapshotPath( settings.record, settings, size, iterations, rgb, vorticity, wrap );
+		passed = writeSnapshot( path, snapshot( solver ) );
+		golden = passed ? "recorded" : "unwritable";
+	}
+	else if ( !settings.verify.empty() )
+	{
+		vector< float > fields = snapshot( solver );
+		vector< float > expected( fields.size() );
+		if ( readSnapshot( snapshotPath( settings.verify, settings, size, iterations, rgb, vorticity, wrap ), &expected ) )
+		{
+			goldenError = snapshotError( fields, expected );
+			passed = goldenError <= settings.tolerance;
+			golden = passed ? "ok" : "fail";
+		}
+		else
+		{
+			passed = false;
+			golden = "missing";
+		}
+	}
+
+	sort( stepTimes.begin(), stepTimes.end() );
+	double p99 = stepTimes[ min( stepTimes.size() - 1, stepTimes.size() * 99 / 100 ) ];
+
+	double cells = double( size.x ) * size.y;
+	output( "%d,%d,%d,%d,%d,%d,%s,%s,%s,%d,%s,%d,%d,%d,%d,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f", size.x, size.y, iterations, rgb, vorticity, wrap,
+			settings.redBlack ? "rb" : "gs", settings.multigrid ? "mg" : "relax",
+			settings.maccormack ? "mc" : "sl", solver.getNumThreads(),
+			solver.getSimdName(), settings.tiles, settings.blocking, settings.stats, settings.fixed, settings.splats,
+			settings.stir, settings.ftz, settings.steps, total * 1e3 / settings.steps, p99 * 1e3, stepTimes.back() * 1e3,
+			total * 1e9 / ( cells * settings.steps ) );
+	for ( int i = 0; i < ciMsaFluidSolver::STAGE_COUNT; i++ )
+	{
+		ciMsaFluidSolver::Stage stage = ciMsaFluidSolver::Stage( i );
+		int calls = solver.getStageCalls( stage );
+		output( ",%.4f", calls ? solver.getStageTime( stage ) * 1e9 / ( cells * calls ) : 0. );
+	}
+	output( ",%.6f,%.6f,%zu,%.9g,%s,%.3g\n", rms, maxError, solver.getMemoryUsage(), checksum( solver ), golden, goldenError );
+	fflush( stdout );
+	return passed;
+}
+
+int main( int argc, char **argv )
+{
+	Settings settings;
+	if ( !parseArgs( argc, argv, &settings ) )
+		usage();
+
+	if ( !settings.report.empty() )
+	{
+		sReport = fopen( settings.report.c_str(), "w" );
+		if ( !sReport )
+		{
+			fprintf( stderr, "cannot write %s\n", settings.report.c_str() );
+			return 1;
+		}
+	}
+
+	output( "size_x,size_y,iterations,rgb,vorticity,wrap,method,projection,advection,threads,simd,tiles,blocking,stats,fixed,splats,stir,ftz,steps,ms_per_step,ms_p99,ms_max,ns_per_cell" );
+	for ( int i = 0; i < ciMsaFluidSolver::STAGE_COUNT; i++ )
+		output( ",ns_per_cell_%s", ciMsaFluidSolver::getStageName( ciMsaFluidSolver::Stage( i ) ) );
+	output( ",color_rms_error,color_max_error,memory_bytes,checksum,golden,golden_error\n" );
+
+	int failed = 0;
+	for ( size_t s = 0; s < settings.sizes.size(); s++ )
+		for ( size_t i = 0; i < settings.iterations.size(); i++ )
+			for ( size_t c = 0; c < settings.rgb.size(); c++ )
+				for ( size_t v = 0; v < settings.vorticity.size(); v++ )
+					for ( size_t w = 0; w < settings.wrap.size(); w++ )
+						if ( !run( settings, settings.sizes[ s ], settings.iterations[ i ],
+								   settings.rgb[ c ] != 0, settings.vorticity[ v ] != 0, settings.wrap[ w ] ) )
+							failed++;
+
+	if ( sReport )
+		fclose( sReport );
+	if ( failed )
+		fprintf( stderr, "%d combinations do not match their snapshots\n", failed );
+	return failed ? 1 : 0;
+}
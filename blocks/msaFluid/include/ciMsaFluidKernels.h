@@ -0,0 +1,122 @@
+/***********************************************************************
+
+ Inner loops of ciMsaFluidSolver with a plain C++ reference version and
+ vectorized versions (SSE2 on x86, NEON on ARM). The vectorized versions
+ give the same results as the reference, except for the order of the
+ additions in the sums of fade and flushZero. The sums are skipped when
+ NULL is passed for them.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+	#include <emmintrin.h>
+#else
+	#include <math.h>
+#endif
+
+#define		FLUID_FIXED_ONE		4096	// steps per unit of the fixed point color, the range is [-8, 8)
+#define		FLUID_DITHER_STEP	0.618034f	// dither added along a row by the fixed point fade
+
+// x in fixed point, rounded to the nearest step with halfway cases to even and saturated at the ends of the range.
+// the kernels and the splats of the solver share it so a value rounds the same in both, and the same as the
+// vector conversion of the sse2 kernels
+inline int16_t ciMsaFluidToFixed( float x )
+{
+	float f = x * FLUID_FIXED_ONE;
+	f = f < -32768.0f ? -32768.0f : ( f > 32767.0f ? 32767.0f : f );
+#if defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+	return (int16_t)_mm_cvtss_si32( _mm_set_ss( f ) );
+#else
+	return (int16_t)lrintf( f );
+#endif
+}
+
+class ciMsaFluidKernels {
+public:
+	// fastest implementation supported by the cpu this is running on
+	static const ciMsaFluidKernels*	getBest();
+	// plain C++ reference implementation
+	static const ciMsaFluidKernels*	getScalar();
+
+	const char	*name;
+
+	// x[i] += dt * x0[i]
+	void	(*addSource)( float *x, const float *x0, float dt, int n );
+
+	// x[i] = min( x[i], 1 ) * hold, values below zeroThresh are flushed to zero
+	// adds the sum of the clamped values and the sum of their squares to sum and sumSq, unless sum is NULL
+	void	(*fade)( float *x, float hold, float zeroThresh, int n, float *sum, float *sumSq );
+
+	// same as fade for the three color planes, the sums are of the largest of the clamped components
+	void	(*fadeRGB)( float *r, float *g, float *b, float hold, float zeroThresh, int n, float *sum, float *sumSq );
+
+	// flushes values below zeroThresh to zero, adds the sum of the squares to sumSq unless it is NULL
+	void	(*flushZero)( float *x, float zeroThresh, int n, float *sumSq );
+
+	// red-black relaxation of a row of n cells, x[k] = ( ( x[k-1] + x[k+1] + x[k-stepX] + x[k+stepX] ) * a + x0[k] ) * c
+	// for the cells with ( k & 1 ) == parity, returns the largest change of a cell
+	float	(*relaxRow)( float *x, const float *x0, int n, int stepX, float a, float c, int parity );
+
+	// semi-lagrangian advection of n cells of row j starting at column i0 in up to three planes
+	// d[p], u and v point to cell (i0, j), d0[p] to cell (0, 0) of the plane, nx and ny are the size of the grid
+	void	(*advectRow)( float *const *d, const float *const *d0, int planes, const float *u, const float *v,
+						  int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y );
+
+	// maccormack correction of a row advected by advectRow, takes the same arguments. back[p] points to cell (i0, j)
+	// of d advected back along the velocity. d[p][k] += ( d0 - back ) / 2 at the cell, clamped to the four cells
+	// of d0[p] the forward step interpolated from so the correction adds no new extrema
+	void	(*maccormackRow)( float *const *d, const float *const *d0, const float *const *back, int planes, const float *u, const float *v,
+							  int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y );
+
+	// the same passes on color planes in 16 bit fixed point, FLUID_FIXED_ONE steps per unit. results are rounded to
+	// the nearest step, except by fade which rounds with a dither starting at phase so the color fades out the way
+	// the float planes do
+	void	(*addSourceFixed)( int16_t *x, const int16_t *x0, float dt, int n );
+	void	(*fadeFixed)( int16_t *x, float hold, float phase, int n, float *sum, float *sumSq );
+	void	(*fadeRGBFixed)( int16_t *r, int16_t *g, int16_t *b, float hold, float phase, int n, float *sum, float *sumSq );
+	void	(*advectRowFixed)( int16_t *const *d, const int16_t *const *d0, int planes, const float *u, const float *v,
+							   int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y );
+	// advects fixed point planes into float ones
+	void	(*advectRowFromFixed)( float *const *d, const int16_t *const *d0, int planes, const float *u, const float *v,
+								   int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y );
+	void	(*maccormackRowFixed)( int16_t *const *d, const int16_t *const *d0, const float *const *back, int planes, const float *u, const float *v,
+								   int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y );
+
+	// converts n values between float and fixed point
+	void	(*toFixed)( int16_t *q, const float *x, int n );
+	void	(*fromFixed)( float *x, const int16_t *q, int n );
+
+	// bilinear samples of u and v at n positions given in normalized coordinates, where (0, 0) is the outer corner
+	// of cell (0, 0) and (1, 1) that of cell (nx + 1, ny + 1). positions past the outer cell centers are clamped
+	void	(*sampleVelocity)( const float *u, const float *v, const float *x, const float *y, float *vx, float *vy,
+							   int n, int nx, int ny, int stepX );
+
+	// vorticity confinement in two passes over rows of n cells. curlRow stores the signed curl of the velocity,
+	// vorticityRow the force along the gradient of its magnitude, which reads the curl one cell around the row
+	void	(*curlRow)( float *curl, const float *u, const float *v, int n, int stepX );
+	void	(*vorticityRow)( float *fx, float *fy, const float *curl, int n, int stepX );
+};
+
+// flushes denormal floats to zero on the calling thread while in scope and puts the previous mode back after.
+// results and inputs that small are flushed, ftz and daz on x86 ( daz only on 64 bit, a few early sse2 cpus fault
+// on it ), fz on ARM. the decaying velocity and color reach the denormal range, where every operation on them
+// can take a hundred cycles or more. with enable false, or on other cpus, the mode is left alone
+class ciMsaFluidDenormalGuard {
+public:
+	explicit ciMsaFluidDenormalGuard( bool enable = true );
+	~ciMsaFluidDenormalGuard();
+
+	// whether denormals are flushed on the calling thread
+	static bool	isEnabled();
+
+private:
+	unsigned	saved;
+	bool		active;
+
+	ciMsaFluidDenormalGuard( const ciMsaFluidDenormalGuard & );
+	ciMsaFluidDenormalGuard& operator=( const ciMsaFluidDenormalGuard & );
+};
@@ -46,8 +46,15 @@
 
 #pragma once
 
+#include <vector>
+
 #include "cinder/Vector.h"
 #include "cinder/Color.h"
+#include "cinder/Thread.h"
+#include "cinder/Timer.h"
+
+#include "ciMsaFluidKernels.h"
+#include "ciMsaFluidThreadPool.h"
 
 // do not change these values, you can override them using the solver methods
 #define		FLUID_DEFAULT_NX					100
@@ -57,16 +64,52 @@
 #define     FLUID_DEFAULT_COLOR_DIFFUSION	0
 #define     FLUID_DEFAULT_FADESPEED         .03
 #define		FLUID_DEFAULT_SOLVER_ITERATIONS		10
+#define		FLUID_DEFAULT_MULTIGRID_CYCLES		2
+#define		FLUID_DEFAULT_ACTIVE_THRESHOLD		1e-5f
+
+#define		FLUID_ROW_ALIGN		16		// rows are padded to a multiple of this many floats (64 bytes, a cache line)
+#define		FLUID_TILE_SIZE		16		// cells along each side of the tiles tracked with enableActiveTiles, even
+#define		FLUID_BLOCK_BYTES	( 256 * 1024 )	// working set of a band of rows relaxed with enableCacheBlocking
 
-#define		FLUID_IX(i, j)		((i) + (_NX + 2)  *(j))
+#define		FLUID_IX(i, j)		((i) + _rowStride  *(j))
 
 class ciMsaFluidSolver {
 public:	
+	enum SolverMethod {
+		SOLVER_GAUSS_SEIDEL,	// in-place lexicographic sweeps on the calling thread
+		SOLVER_RED_BLACK		// red-black ordered sweeps, each color split into row bands on the thread pool
+	};
+	
+	enum ProjectionMethod {
+		PROJECTION_RELAXATION,	// solverIterations sweeps of the linear solver, the original scheme
+		PROJECTION_MULTIGRID	// geometric multigrid V-cycles on the divergence
+	};
+	
+	enum AdvectionMethod {
+		ADVECTION_SEMI_LAGRANGIAN,	// first order, bilinear interpolation at the cell traced back along the velocity
+		ADVECTION_MACCORMACK		// semi-lagrangian step with a limited second order error correction
+	};
+	
+	// parts of update() timed with enableStageTimes
+	enum Stage {
+		STAGE_SPLAT,		// queued splats
+		STAGE_ADD_SOURCE,
+		STAGE_VORTICITY,
+		STAGE_DIFFUSE,
+		STAGE_PROJECT,
+		STAGE_ADVECT,
+		STAGE_FADE,			// fade, statistics and active tile bookkeeping
+		STAGE_COUNT
+	};
+
 	ciMsaFluidSolver();
 	virtual ~ciMsaFluidSolver();
 	
 	ciMsaFluidSolver& setup(int NX = FLUID_DEFAULT_NX, int NY = FLUID_DEFAULT_NY);
 	ciMsaFluidSolver& setSize(int NX = FLUID_DEFAULT_NX, int NY = FLUID_DEFAULT_NY);
+	// changes the size of the grid keeping the fluid, the velocity and the color are resampled into the new cells.
+	// unlike setSize the queued splats stay as well, so the grid can follow the frame time while it runs
+	ciMsaFluidSolver& resize( int NX, int NY );
 	
 	// solve one step of the fluid solver
 	void update();
@@ -89,11 +132,15 @@ public:
 	inline void getInfoAtPos(float x, float y, ci::Vec2f *vel, ci::Color *color = NULL) const;
 	
 	inline ci::Vec2f getVelocityAtPos( const ci::Vec2f &pos ) const;
+
+	// bilinear velocity at n normalized positions given as separate x and y arrays, into vx and vy.
+	// samples a whole batch of particles at once, with the nearest cell of getVelocityAtPos blended smoothly
+	void getVelocityAtPositions( const float *x, const float *y, float *vx, float *vy, int n ) const;
 	
 	// get info at fluid cell pixels (i, j) if you know it. range: (0..NX-1), (0..NY-1)
 	inline	void getInfoAtCell(int i, int j, ci::Vec2f *vel, ci::Color *color = NULL) const;
 	
-	// get info at fluid cell index if you know it. range: (0..numCells)
+	// get info at fluid cell index if you know it, as returned by getIndexForCellPosition
 	inline	void getInfoAtCell(int index, ci::Vec2f *vel, ci::Color *color = NULL) const;
 	
 	// add force at normalized (x, y) coordinates
@@ -114,6 +161,21 @@ public:
 	inline void addColorAtCell(int i, int j, float r, float g=0, float b=0 );
 	inline void addColorAtCell(int i, int j, float* rgb );
 	
+	// force and color spread over the cells within radius of pos, pos in normalized coordinates and radius
+	// as a fraction of the width. the cells are weighted by a smooth falloff adding up to one, so a splat
+	// adds the same totals as addForceAtPos and addColorAtPos, which is what a radius under half a cell does
+	struct Splat {
+		ci::Vec2f	pos;
+		ci::Vec2f	force;
+		ci::Color	color;
+		float		radius;
+	};
+	
+	// queue splats for the start of the next update, which adds them all in one pass over the rows.
+	// safe to call from any thread, also while update runs
+	void addSplats( const Splat *splats, int count );
+	void addSplat( const Splat &splat ) { addSplats( &splat, 1 ); }
+	
 	// fill with random color at every cell
 	void randomizeColor();
 		
@@ -124,6 +186,10 @@ public:
 	
 	bool isInited() const;
 	
+	// bytes held by the solver, and the part of the plane arena the current grid and color format use
+	size_t getMemoryUsage() const;
+	size_t getArenaSize() const;
+	
 	// accessors for  viscocity, it will lerp to the target at lerpspeed
 	ciMsaFluidSolver& setVisc(float newVisc); 
 	float getVisc() const;
@@ -138,6 +204,87 @@ public:
 	ciMsaFluidSolver& setDeltaT(float dt = FLUID_DEFAULT_DT);
 	ciMsaFluidSolver& setFadeSpeed(float fadeSpeed = FLUID_DEFAULT_FADESPEED);
 	ciMsaFluidSolver& setSolverIterations(int solverIterations = FLUID_DEFAULT_SOLVER_ITERATIONS);
+	
+	// stop the linear solver sweeps once a sweep changes no cell by more than tolerance (in velocity units)
+	// solverIterations is the maximum number of sweeps then, 0 always does solverIterations sweeps
+	ciMsaFluidSolver& setSolverTolerance( float tolerance );
+	float getSolverTolerance() const;
+	
+	// number of linear solver sweeps done in the last update
+	int getSolverIterationsUsed() const;
+	
+	// largest change a final sweep made to a cell in the last update, in velocity units like the tolerance.
+	// this is not the residual of the equations, a slowly converging solve changes little per sweep
+	float getSolverChange() const;
+	
+	// ordering of the linear solver sweeps, red-black converges at about the same rate
+	// as gauss-seidel but the cells of one color can be relaxed in parallel
+	ciMsaFluidSolver& setSolverMethod( SolverMethod method );
+	SolverMethod getSolverMethod() const;
+	
+	// pressure solver used by the projection step. the relaxation smooths the divergence as the original
+	// msaFluid did and keeps its look, multigrid solves the pressure equation and removes far more divergence
+	ciMsaFluidSolver& setProjectionMethod( ProjectionMethod method );
+	ProjectionMethod getProjectionMethod() const;
+	
+	// scheme used to move velocity and color, MacCormack keeps much finer detail for about three times the cost of the advection
+	ciMsaFluidSolver& setAdvectionMethod( AdvectionMethod method );
+	AdvectionMethod getAdvectionMethod() const;
+	
+	// number of V-cycles per projection with PROJECTION_MULTIGRID
+	ciMsaFluidSolver& setMultigridCycles( int cycles = FLUID_DEFAULT_MULTIGRID_CYCLES );
+	
+	// rms residual of the pressure equation after the last projection of an update with enableStats
+	float getProjectionResidual() const;
+	
+	// number of threads used by the red-black solver, 0 uses the hardware concurrency
+	ciMsaFluidSolver& setNumThreads( int numThreads );
+	int getNumThreads() const;
+	
+	// use the sse2 / neon inner loops when the cpu supports them, on by default
+	ciMsaFluidSolver& enableSimd( bool b );
+	// name of the inner loops in use, "scalar", "sse2" or "neon"
+	const char* getSimdName() const;
+	
+	// flush denormal floats to zero during update, on the calling thread and on the workers, on by default.
+	// the fading velocity and color would otherwise spend a while in the denormal range, which is slow on most cpus
+	ciMsaFluidSolver& enableDenormalFlush( bool b );
+	bool getDenormalFlush() const;
+	
+	// only update the tiles with fluid in them, those touched by addForce / addColor and their neighbours.
+	// a tile comes to rest once no velocity or color in it exceeds threshold and is cleared then, off by default.
+	// with vorticity confinement on the whole grid is updated, the confinement force reaches past the tiles at rest
+	ciMsaFluidSolver& enableActiveTiles( bool b, float threshold = FLUID_DEFAULT_ACTIVE_THRESHOLD );
+	bool getActiveTiles() const;
+	
+	// number of tiles updated by the last update, and of all tiles
+	int getNumActiveTiles() const;
+	int getNumTiles() const;
+	
+	// relax the red-black sweeps band by band, several sweeps per pass over a band of rows small enough to stay
+	// in the cache, with the same results as the plain sweeps. used with SOLVER_RED_BLACK and no solver tolerance, off by default
+	ciMsaFluidSolver& enableCacheBlocking( bool b );
+	bool getCacheBlocking() const;
+	
+	// sum the density, uniformity and speed returned by getAvgDensity, getUniformity and getAvgSpeed
+	// and the residual of getProjectionResidual at the end of each update. when off they keep the values
+	// of the last update with stats, on by default
+	ciMsaFluidSolver& enableStats( bool b );
+	bool getStats() const;
+	
+	// keep the color in 16 bit fixed point instead of float, which halves the memory and bandwidth of the color
+	// passes. the color takes steps of 1 / FLUID_FIXED_ONE and saturates at -8 and 8, off by default
+	ciMsaFluidSolver& enableFixedColor( bool b );
+	bool getFixedColor() const;
+	
+	// accumulates the time spent in each stage of update(), off by default
+	ciMsaFluidSolver& enableStageTimes( bool b );
+	void resetStageTimes();
+	// seconds spent in stage and number of times it ran since the last reset
+	double getStageTime( Stage stage ) const;
+	int getStageCalls( Stage stage ) const;
+	static const char* getStageName( Stage stage );
+	
 	ciMsaFluidSolver& enableVorticityConfinement(bool b);
 	bool getVorticityConfinement();
 	ciMsaFluidSolver& setWrap( bool bx, bool by );
@@ -152,20 +299,94 @@ public:
 	float getAvgSpeed() const;
 
   protected:			
-	// allocate an array large enough to hold information for u, v, r, g, OR b
-	float* alloc()	{ return new float[_numCells];	}
+	// all the planes are carved from one aligned block, reused by reset and setSize while it is large enough
+	char	*arena;
+	size_t	arenaCapacity;
+	size_t	arenaSize;
+	void	arrangePlanes( bool fixedColor, bool withScratch, bool keep );
+	void	setPlanes( char *velocity, char *color, char *fixedColor, char *scratchPlanes );
+	bool	needsScratch() const;
+	void	arrangeScratch();
+	void	resamplePlanes( float *const *dst, const float *const *src, int planes, int srcNX, int srcNY, int srcStride );
 
 	float	*r, *rOld;
 	float	*g, *gOld;
 	float	*b, *bOld;
 	
-	ci::Vec2f	*uv, *uvOld;
+	// the color planes in fixed point, used instead of r .. bOld with enableFixedColor
+	int16_t	*rFixed, *rFixedOld;
+	int16_t	*gFixed, *gFixedOld;
+	int16_t	*bFixed, *bFixedOld;
+	bool	doFixedColor;
+	float	ditherPhase;
+	
+	// velocity components in separate planes
+	float	*u, *v;
+	float	*uOld, *vOld;
 
-	float	*curl;
+	float	*curl;			// signed, cached by vorticityConfinement for its second pass
+	
+	AdvectionMethod	advectionMethod;
+	float	*scratch[3];		// only in the arena for the MacCormack correction and the diffusion of fixed point color
 	
 	bool	doRGB;				// for monochrome, only update r
 	bool	doVorticityConfinement;
 	int		solverIterations;
+	SolverMethod	solverMethod;
+	ProjectionMethod	projectionMethod;
+	int		multigridCycles;
+	float	projectionResidual;
+	float	solverTolerance;
+	int		solverIterationsUsed;
+	float	solverChange;
+	
+	// active tiles
+	struct CellSpan {
+		int		i0, n;			// n cells of a row from column i0
+	};
+	bool	doActiveTiles;
+	float	activeThreshold;
+	int		tilesX, tilesY;
+	int		numActiveTiles;
+	std::vector< unsigned char >	activeTiles;	// tiles with fluid in them or touched since the last update
+	std::vector< CellSpan >		tileSpans;		// cells updated in this step, by tile row
+	std::vector< int >			tileSpanStart;	// first span of each tile row, tilesY + 1 entries
+	
+	inline	bool	useActiveTiles() const;
+	inline	void	touchCell( int i, int j );
+	inline	const CellSpan*	spansBegin( int j ) const;
+	inline	const CellSpan*	spansEnd( int j ) const;
+	void	findActiveSpans();
+	void	updateActiveTiles();
+	template< typename Fn > void	forEachPlaneSpan( Fn fn ) const;
+	template< typename Fn > void	forEachPlaneSpan( int j0, int j1, Fn fn ) const;
+	
+	// splats, queued under splatMutex and swapped into splatBatch by update
+	struct SplatFootprint {
+		float	x, y;			// center in cells
+		float	invRadiusSq;
+		float	norm;			// one over the sum of the weights
+		int		i0, i1, j0, j1;	// cells covered
+	};
+	std::mutex	splatMutex;
+	std::vector< Splat >	splatQueue;
+	std::vector< Splat >	splatBatch;
+	std::vector< SplatFootprint >	splatFootprints;
+	void	applySplats();
+	inline	static	float	splatWeight( const SplatFootprint &f, int i, int j );
+	
+	// stage times
+	bool	doStageTimes;
+	double	stageTimes[ STAGE_COUNT ];
+	int		stageCalls[ STAGE_COUNT ];
+	ci::Timer	stageTimer;
+	double		stageStart;
+	
+	void	endStage( Stage stage );
+	
+	ciMsaFluidThreadPool	threadPool;
+	const ciMsaFluidKernels	*kernels;
+	bool	doFlushDenormals;
 	
 	float	colorDiffusion;
 	float	viscocity;
@@ -181,6 +402,8 @@ public:
 
 	
 	int		_NX, _NY, _numCells;
+	int		_rowStride;			// floats from one row to the next, _NX + 2 padded to FLUID_ROW_ALIGN
+	int		_planeSize;			// floats in each plane, _rowStride * (_NY + 2)
 	float	_invNX, _invNY, _invNumCells;
 	float	_dt;
 	bool	_isInited;
@@ -190,33 +413,89 @@ public:
 	float	_uniformity;			// this will hold the _uniformity of the last frame (how uniform the color is);
 	float	_avgSpeed;
 	
+	// sums of the fade, by block of rows
+	struct FadeSums {
+		float	speed, density, densitySq;
+	};
+	bool	doStats;
+	std::vector< FadeSums >	fadeSums;
+	
 	void	destroy();
 	
-	inline	float	calcCurl(int i, int j);
-	void	vorticityConfinement(ci::Vec2f *Fvc_xy);
+	void	vorticityConfinement(float *Fvc_x, float *Fvc_y);
 	
 	void	addSource(float *x, float *x0);
 	void	addSourceUV();		// does both U and V in one go
 	void	addSourceRGB();	// does R, G, and B in one go
 	
-	void	advect(int b, float *d, const float *d0, const ci::Vec2f *duv);
-	void	advect2d( ci::Vec2f *uv, const ci::Vec2f *duv );
-	void	advectRGB(int b, const ci::Vec2f *duv);
+	void	advect(int b, float *d, const float *d0, const float *du, const float *dv);
+	void	advect2d( float *u, float *v, const float *du, const float *dv );
+	void	advectRGB(int b, const float *du, const float *dv);
+	void	advectPlanes( float *const *d, const float *const *d0, int planes, const float *du, const float *dv, float dtScale = 1 );
+	void	correctAdvection( float *const *d, const float *const *d0, int planes, const float *du, const float *dv );
+	
+	// fixed point color
+	inline	static	int16_t	toFixedColor( float x );
+	inline	static	float	fromFixedColor( int16_t q );
+	void	addSourceFixed();
+	void	diffuseFixed( float diff );
+	void	advectFixed( const float *du, const float *dv );
+	void	setBoundaryFixed( int16_t *x, bool corners );
 	
 	void	diffuse(int b, float *c, float *c0, float diff);
 	void	diffuseRGB(int b, float diff);
 	void	diffuseUV(float diff);
 	
-	void	project(ci::Vec2f *xy, ci::Vec2f *pDiv);
+	void	project(float *x, float *y, float *p, float *div, bool residual = false);
 	void	linearSolver(int b, float *x, const float *x0, float a, float c);
-	void	linearSolverProject( ci::Vec2f *pdiv );
+	void	linearSolverProject( float *p, const float *div );
 	void	linearSolverRGB( float a, float c);
 	void	linearSolverUV(float a, float c);
 	
+	bool	isSolverConverged( float delta );
+	void	endSolve( float delta );
+	float	getPressureScale() const;
+	
+	void	linearSolverRedBlack(int b, float *x, const float *x0, float a, float c);
+	void	linearSolverProjectRedBlack( float *p, const float *div );
+	void	linearSolverRGBRedBlack( float a, float c);
+	void	linearSolverUVRedBlack(float a, float c);
+	
+	// cache blocking
+	struct RelaxPlane {
+		float		*x;
+		const float	*x0;
+		int			edgeSign;		// sign the left and right edges take, 0 leaves them
+		int			rowSign;		// same for the top and bottom rows
+		bool		corners;
+	};
+	bool	doCacheBlocking;
+	
+	bool	canBlockRelaxation() const;
+	float	relaxBlocked( const RelaxPlane *planes, int numPlanes, float a, float c );
+	float	relaxBlockedRow( const RelaxPlane *planes, int numPlanes, int j, int level, float a, float c );
+	
+	// pressure grid hierarchy, level 0 has the resolution of the fluid
+	struct MultigridLevel {
+		int						nx, ny;
+		std::vector< float >	p, rhs, res;
+	};
+	std::vector< MultigridLevel >	multigridLevels;
+	
+	void	linearSolverProjectMultigrid( float *p, const float *div );
+	void	setupMultigrid();
+	void	multigridVCycle( int level );
+	void	multigridSmooth( MultigridLevel &level, int iterations );
+	void	multigridResidual( MultigridLevel &level );
+	void	multigridRestrict( const MultigridLevel &fine, MultigridLevel &coarse );
+	void	multigridProlongate( const MultigridLevel &coarse, MultigridLevel &fine );
+	void	setBoundaryMultigrid( const MultigridLevel &level, float *x );
+	float	calcProjectionResidual( const float *p, const float *x, const float *y ) const;
+	
 	void	setBoundary(int b, float *x);
-	void	setBoundary02d(ci::Vec2f* x);
-	void	setBoundary2d(int b, ci::Vec2f *xy );
+	void	setBoundary2d(int b, float *u, float *v);
 	void	setBoundaryRGB();
+	void	setCorners(float *x);
 	
 	void	swapUV();
 	void	swapU(); 
@@ -226,6 +505,7 @@ public:
 	
 	void	fadeR();
 	void	fadeRGB();
+	FadeSums	fadePlanes( float holdAmount );
 };
 
 
@@ -243,8 +523,16 @@ inline int ciMsaFluidSolver::getIndexForNormalizedPosition(float x, float y) con
 
 inline	void ciMsaFluidSolver::getInfoAtCell(int i, ci::Vec2f *vel, ci::Color *color) const {
 	if(vel)
-		vel->set(uv[i].x * _invNX, uv[i].y * _invNY);
-	if(color)
+		vel->set(u[i] * _invNX, v[i] * _invNY);
+	if(color && doFixedColor)
+	{
+		float fr = fromFixedColor( rFixed[i] );
+		if(doRGB)
+			color->set( ci::CM_RGB, ci::Vec3f( fr, fromFixedColor( gFixed[i] ), fromFixedColor( bFixed[i] ) ) );
+		else
+			color->set( ci::CM_RGB, ci::Vec3f( fr, fr, fr ) );
+	}
+	else if(color)
 	{
 		if(doRGB)
 			color->set( ci::CM_RGB, ci::Vec3f( r[i], g[i], b[i] ) );
@@ -265,7 +553,7 @@ inline ci::Vec2f ciMsaFluidSolver::getVelocityAtPos( const ci::Vec2f &pos ) cons
 	i = ci::constrain<int>( i, 0, _NX+1 );
 	j = ci::constrain<int>( j, 0, _NY+1 );
 	int o = FLUID_IX( i, j );
-	return ci::Vec2f( uv[o].x, uv[o].y );	
+	return ci::Vec2f( u[o], v[o] );	
 }
 
 inline	void ciMsaFluidSolver::getInfoAtCell(int i, int j, ci::Vec2f *vel, ci::Color *color) const {
@@ -284,20 +572,34 @@ inline void ciMsaFluidSolver::addForceAtPos(const ci::Vec2f &pos, const ci::Vec2
 
 inline	void ciMsaFluidSolver::addForceAtCell(int i, int j, const ci::Vec2f &force )
 {
+	touchCell( i, j );
 	int index = FLUID_IX(i, j);
-	uv[index].x += force.x;
-	uv[index].y += force.y;
+	u[index] += force.x;
+	v[index] += force.y;
 }
 
 inline void ciMsaFluidSolver::addColorAtCell(int i, int j, float r, float g, float b )
 {
 	//      if(safeToRun()){
+	touchCell( i, j );
 	int index = FLUID_IX(i, j);
-	rOld[index] += r;
-	if(doRGB)
+	if(doFixedColor)
+	{
+		rFixedOld[index] = toFixedColor( fromFixedColor( rFixedOld[index] ) + r );
+		if(doRGB)
+		{
+			gFixedOld[index] = toFixedColor( fromFixedColor( gFixedOld[index] ) + g );
+			bFixedOld[index] = toFixedColor( fromFixedColor( bFixedOld[index] ) + b );
+		}
+	}
+	else
 	{
-		gOld[index] += g;
-		bOld[index] += b;
+		rOld[index] += r;
+		if(doRGB)
+		{
+			gOld[index] += g;
+			bOld[index] += b;
+		}
 	}
 	//              unlock();
 	//      }
@@ -317,3 +619,50 @@ inline void ciMsaFluidSolver::addColorAtCell(int i, int j, float* rgb )
 	addColorAtCell( i, j, rgb[0], rgb[1], rgb[2] );
 }
 
+// rounds the way the kernels store fixed point color
+inline int16_t ciMsaFluidSolver::toFixedColor( float x )
+{
+	return ciMsaFluidToFixed( x );
+}
+
+inline float ciMsaFluidSolver::fromFixedColor( int16_t q )
+{
+	return q * ( 1.0f / FLUID_FIXED_ONE );
+}
+
+// smooth falloff from one at the center to zero at the radius, (1 - d^2)^3
+inline float ciMsaFluidSolver::splatWeight( const SplatFootprint &f, int i, int j )
+{
+	float dx = i + 0.5f - f.x;
+	float dy = j + 0.5f - f.y;
+	float t = 1.0f - ( dx * dx + dy * dy ) * f.invRadiusSq;
+	return t > 0 ? t * t * t : 0;
+}
+
+// the curl spreads the vorticity force past the tiles at rest, so it runs on the full grid
+inline bool ciMsaFluidSolver::useActiveTiles() const
+{
+	return doActiveTiles && !doVorticityConfinement;
+}
+
+inline void ciMsaFluidSolver::touchCell( int i, int j )
+{
+	if( !useActiveTiles() )
+		return;
+	int tx = ci::constrain<int>( ( i - 1 ) / FLUID_TILE_SIZE, 0, tilesX - 1 );
+	int ty = ci::constrain<int>( ( j - 1 ) / FLUID_TILE_SIZE, 0, tilesY - 1 );
+	activeTiles[ tx + tilesX * ty ] = 1;
+}
+
+// spans of row j updated in this step, boundary rows belong to the tile row next to them
+inline const ciMsaFluidSolver::CellSpan* ciMsaFluidSolver::spansBegin( int j ) const
+{
+	int ty = ci::constrain<int>( ( j - 1 ) / FLUID_TILE_SIZE, 0, tilesY - 1 );
+	return tileSpans.data() + tileSpanStart[ ty ];
+}
+
+inline const ciMsaFluidSolver::CellSpan* ciMsaFluidSolver::spansEnd( int j ) const
+{
+	int ty = ci::constrain<int>( ( j - 1 ) / FLUID_TILE_SIZE, 0, tilesY - 1 );
+	return tileSpans.data() + tileSpanStart[ ty + 1 ];
+}
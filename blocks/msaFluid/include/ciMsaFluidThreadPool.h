@@ -0,0 +1,63 @@
+/***********************************************************************
+
+ Small persistent worker pool used by ciMsaFluidSolver to split grid
+ sweeps into row bands.
+
+ ***********************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include "cinder/Thread.h"
+
+// vs2010 has no <atomic>, the boost that comes with cinder has the same interface
+#if defined( _MSC_VER ) && ( _MSC_VER < 1700 )
+	#include <boost/atomic.hpp>
+	namespace std {
+		using boost::atomic;
+		using boost::memory_order_acquire;
+		using boost::memory_order_release;
+		namespace this_thread {
+			using boost::this_thread::yield;
+		}
+	}
+#else
+	#include <atomic>
+#endif
+
+class ciMsaFluidThreadPool {
+public:
+	ciMsaFluidThreadPool();
+	~ciMsaFluidThreadPool();
+
+	// number of threads working on a parallelFor including the calling thread
+	// 0 uses the hardware concurrency, 1 runs everything on the calling thread
+	void	setNumThreads( int numThreads );
+	int		getNumThreads() const { return (int)workers.size() + 1; }
+
+	// splits [begin, end) into getNumThreads() contiguous chunks and calls
+	// fn( chunkBegin, chunkEnd ) for each of them, returns when all chunks are done.
+	// the workers flush denormals for the chunks when the calling thread does
+	void	parallelFor( int begin, int end, const std::function< void ( int, int ) > &fn );
+
+protected:
+	void	workerFn( int chunk, unsigned seen );
+	void	stop();
+
+	std::vector< std::thread >	workers;
+	std::mutex					mutex;
+	std::condition_variable		cond;
+	std::atomic< unsigned >		generation;
+	std::atomic< int >			pending;
+	std::atomic< bool >			quit;
+
+	const std::function< void ( int, int ) >	*job;
+	int		jobBegin, jobEnd;
+	bool	jobFlushDenormals;
+
+private:
+	ciMsaFluidThreadPool( const ciMsaFluidThreadPool & );
+	ciMsaFluidThreadPool& operator=( const ciMsaFluidThreadPool & );
+};
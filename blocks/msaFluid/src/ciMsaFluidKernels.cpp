@@ -0,0 +1,1118 @@
+/***********************************************************************
+
+ Inner loops of ciMsaFluidSolver with a plain C++ reference version and
+ vectorized versions (SSE2 on x86, NEON on ARM). The vectorized versions
+ give the same results as the reference, except for the order of the
+ additions in the sums of fade and flushZero. The passes over color come
+ in a float and a 16 bit fixed point version of the same template.
+
+ ***********************************************************************/
+
+#include <cmath>
+
+#include "ciMsaFluidKernels.h"
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+	#define FLUID_KERNELS_SSE2
+	#include <emmintrin.h>
+	#if defined( _MSC_VER )
+		#include <intrin.h>
+	#endif
+#elif defined( __ARM_NEON__ ) || defined( __ARM_NEON )
+	#define FLUID_KERNELS_NEON
+	#include <arm_neon.h>
+#endif
+
+// Scalar reference
+
+// planes of color are either float or 16 bit fixed point with FLUID_FIXED_ONE steps per unit
+static inline float loadValue( float x )
+{
+	return x;
+}
+
+static inline float loadValue( int16_t q )
+{
+	return q * ( 1.0f / FLUID_FIXED_ONE );
+}
+
+static inline void storeValue( float *x, float f )
+{
+	*x = f;
+}
+
+static inline void storeValue( int16_t *q, float f )
+{
+	*q = ciMsaFluidToFixed( f );
+}
+
+// the faded floats are flushed to zero below zeroThresh. the fixed point kernels take the phase of a dither in
+// its place and round the i-th value down after adding frac( phase + i * FLUID_DITHER_STEP ), so on average a
+// value keeps exactly what the fade leaves of it. rounding to nearest would stop small values from fading at all
+// and rounding toward zero would take a whole step off them every frame
+static inline void storeFaded( float *x, float f, float zeroThresh, int )
+{
+	*x = fabsf( f ) < zeroThresh ? 0 : f;
+}
+
+static inline void storeFaded( int16_t *q, float f, float phase, int i )
+{
+	float d = phase + (float)i * FLUID_DITHER_STEP;
+	d -= (float)(int)d;
+	f *= FLUID_FIXED_ONE;
+	f = f < -32768.0f ? -32768.0f : ( f > 32767.0f ? 32767.0f : f );
+	// offset so truncation rounds down, the pack saturates the one value that can reach 32768
+	int k = (int)( ( f + d ) + 32768.0f ) - 32768;
+	*q = (int16_t)( k > 32767 ? 32767 : k );
+}
+
+template< typename T >
+static void addSourceScalar( T *x, const T *x0, float dt, int n )
+{
+	for( int i = 0; i < n; ++i )
+		storeValue( x + i, loadValue( x[i] ) + dt * loadValue( x0[i] ) );
+}
+
+template< typename TD, typename TS >
+static void convertScalar( TD *d, const TS *s, int n )
+{
+	for( int i = 0; i < n; ++i )
+		storeValue( d + i, loadValue( s[i] ) );
+}
+
+// first is the index of x[0] in the call of the kernel, so the simd tails keep to the same dither
+template< typename T, bool stats >
+static void fadeScalarT( T *x, float hold, float zeroThresh, int n, float *sum, float *sumSq, int first = 0 )
+{
+	float s = 0;
+	float sq = 0;
+	for( int i = 0; i < n; ++i )
+	{
+		float t = loadValue( x[i] );
+		t = t < 1.0f ? t : 1.0f;
+		if( stats )
+		{
+			s += t;
+			sq += t * t;
+		}
+		storeFaded( x + i, t * hold, zeroThresh, first + i );
+	}
+	if( stats )
+	{
+		*sum += s;
+		*sumSq += sq;
+	}
+}
+
+template< typename T >
+static void fadeScalar( T *x, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeScalarT< T, true >( x, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeScalarT< T, false >( x, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< typename T, bool stats >
+static void fadeRGBScalarT( T *r, T *g, T *b, float hold, float zeroThresh, int n, float *sum, float *sumSq, int first = 0 )
+{
+	float s = 0;
+	float sq = 0;
+	for( int i = 0; i < n; ++i )
+	{
+		float tr = loadValue( r[i] );
+		float tg = loadValue( g[i] );
+		float tb = loadValue( b[i] );
+		tr = tr < 1.0f ? tr : 1.0f;
+		tg = tg < 1.0f ? tg : 1.0f;
+		tb = tb < 1.0f ? tb : 1.0f;
+		if( stats )
+		{
+			float density = tg > tb ? tg : tb;
+			density = tr > density ? tr : density;
+			s += density;
+			sq += density * density;
+		}
+		storeFaded( r + i, tr * hold, zeroThresh, first + i );
+		storeFaded( g + i, tg * hold, zeroThresh, first + i );
+		storeFaded( b + i, tb * hold, zeroThresh, first + i );
+	}
+	if( stats )
+	{
+		*sum += s;
+		*sumSq += sq;
+	}
+}
+
+template< typename T >
+static void fadeRGBScalar( T *r, T *g, T *b, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeRGBScalarT< T, true >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeRGBScalarT< T, false >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< bool stats >
+static void flushZeroScalarT( float *x, float zeroThresh, int n, float *sumSq )
+{
+	float sq = 0;
+	for( int i = 0; i < n; ++i )
+	{
+		if( stats )
+			sq += x[i] * x[i];
+		if( fabsf( x[i] ) < zeroThresh )
+			x[i] = 0;
+	}
+	if( stats )
+		*sumSq += sq;
+}
+
+static void flushZeroScalar( float *x, float zeroThresh, int n, float *sumSq )
+{
+	if( sumSq )
+		flushZeroScalarT< true >( x, zeroThresh, n, sumSq );
+	else
+		flushZeroScalarT< false >( x, zeroThresh, n, sumSq );
+}
+
+static float relaxRowScalar( float *x, const float *x0, int n, int stepX, float a, float c, int parity )
+{
+	float delta = 0;
+	for( int k = parity; k < n; k += 2 )
+	{
+		float old = x[k];
+		x[k] = ( ( x[k-1] + x[k+1] + x[k - stepX] + x[k + stepX] ) * a + x0[k] ) * c;
+		float d = fabsf( x[k] - old );
+		delta = d > delta ? d : delta;
+	}
+	return delta;
+}
+
+static void curlRowScalar( float *curl, const float *u, const float *v, int n, int stepX )
+{
+	for( int k = 0; k < n; ++k )
+		curl[k] = ( ( u[k + stepX] - u[k - stepX] ) - ( v[k + 1] - v[k - 1] ) ) * 0.5f;
+}
+
+// the gradient skips the halving of the central differences, the 2 of the normalization makes up for it
+static void vorticityRowScalar( float *fx, float *fy, const float *curl, int n, int stepX )
+{
+	for( int k = 0; k < n; ++k )
+	{
+		float dw_dx = fabsf( curl[k + 1] ) - fabsf( curl[k - 1] );
+		float dw_dy = fabsf( curl[k + stepX] ) - fabsf( curl[k - stepX] );
+		float length = 2.0f / ( sqrtf( dw_dx * dw_dx + dw_dy * dw_dy ) + 0.000001f );
+		fx[k] = dw_dy * length * -curl[k];
+		fy[k] = dw_dx * length * curl[k];
+	}
+}
+
+// clamps the position (x, y) to the grid, returns the index of the cell above and left of it and its offset from there
+static inline int backtraceCell( float x, float y, int nx, int ny, int stepX, float *s1, float *t1 )
+{
+	if( x > nx + 0.5f ) x = nx + 0.5f;
+	if( x < 0.5f ) x = 0.5f;
+	if( y > ny + 0.5f ) y = ny + 0.5f;
+	if( y < 0.5f ) y = 0.5f;
+
+	int i0 = (int)x;
+	int j0 = (int)y;
+
+	*s1 = x - i0;
+	*t1 = y - j0;
+	return i0 + stepX * j0;
+}
+
+template< typename TD, typename TS >
+static void advectCell( TD *const *d, const TS *const *d0, int planes, int k, float x, float y, int nx, int ny, int stepX )
+{
+	float s1, t1;
+	int index = backtraceCell( x, y, nx, ny, stepX, &s1, &t1 );
+	float s0 = 1 - s1;
+	float t0 = 1 - t1;
+
+	for( int p = 0; p < planes; ++p )
+	{
+		const TS *src = d0[p];
+		float c00 = loadValue( src[index] );
+		float c01 = loadValue( src[index + stepX] );
+		float c10 = loadValue( src[index + 1] );
+		float c11 = loadValue( src[index + stepX + 1] );
+		storeValue( d[p] + k, s0 * ( t0 * c00 + t1 * c01 ) + s1 * ( t0 * c10 + t1 * c11 ) );
+	}
+}
+
+template< typename T >
+static void maccormackCell( T *const *d, const T *const *d0, const float *const *back, int planes, int k, int cell,
+							float x, float y, int nx, int ny, int stepX )
+{
+	float s1, t1;
+	int index = backtraceCell( x, y, nx, ny, stepX, &s1, &t1 );
+
+	for( int p = 0; p < planes; ++p )
+	{
+		const T *src = d0[p];
+		float c00 = loadValue( src[index] );
+		float c01 = loadValue( src[index + stepX] );
+		float c10 = loadValue( src[index + 1] );
+		float c11 = loadValue( src[index + stepX + 1] );
+		float lo = fminf( fminf( c00, c01 ), fminf( c10, c11 ) );
+		float hi = fmaxf( fmaxf( c00, c01 ), fmaxf( c10, c11 ) );
+		float corrected = loadValue( d[p][k] ) + 0.5f * ( loadValue( src[cell] ) - back[p][k] );
+		storeValue( d[p] + k, corrected < lo ? lo : ( corrected > hi ? hi : corrected ) );
+	}
+}
+
+// cell of the grid above and left of a normalized position and the offsets from its center, as in sampleVelocity
+static inline int sampleCell( float px, float py, int nx, int ny, int stepX, float *s1, float *t1 )
+{
+	float x = px * ( nx + 2 ) - 0.5f;
+	float y = py * ( ny + 2 ) - 0.5f;
+	x = x > 0 ? x : 0;
+	y = y > 0 ? y : 0;
+	x = x < nx + 1 ? x : nx + 1;
+	y = y < ny + 1 ? y : ny + 1;
+
+	float i0 = (float)(int)x;
+	float j0 = (float)(int)y;
+	i0 = i0 < nx ? i0 : nx;
+	j0 = j0 < ny ? j0 : ny;
+	*s1 = x - i0;
+	*t1 = y - j0;
+	return (int)( i0 + stepX * j0 );
+}
+
+static void sampleVelocityScalar( const float *u, const float *v, const float *x, const float *y, float *vx, float *vy,
+								  int n, int nx, int ny, int stepX )
+{
+	for( int k = 0; k < n; ++k )
+	{
+		float s1, t1;
+		int index = sampleCell( x[k], y[k], nx, ny, stepX, &s1, &t1 );
+		float s0 = 1 - s1;
+		float t0 = 1 - t1;
+		vx[k] = s0 * ( t0 * u[index] + t1 * u[index + stepX] ) + s1 * ( t0 * u[index + 1] + t1 * u[index + stepX + 1] );
+		vy[k] = s0 * ( t0 * v[index] + t1 * v[index + stepX] ) + s1 * ( t0 * v[index + 1] + t1 * v[index + stepX + 1] );
+	}
+}
+
+template< typename TD, typename TS >
+static void advectRowScalar( TD *const *d, const TS *const *d0, int planes, const float *u, const float *v,
+							 int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y )
+{
+	for( int k = 0; k < n; ++k )
+	{
+		float x = ( i0 + k ) - dt0x * u[k];
+		float y = j - dt0y * v[k];
+		advectCell( d, d0, planes, k, x, y, nx, ny, stepX );
+	}
+}
+
+template< typename T >
+static void maccormackRowScalar( T *const *d, const T *const *d0, const float *const *back, int planes, const float *u, const float *v,
+								 int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y )
+{
+	for( int k = 0; k < n; ++k )
+	{
+		float x = ( i0 + k ) - dt0x * u[k];
+		float y = j - dt0y * v[k];
+		maccormackCell( d, d0, back, planes, k, i0 + k + stepX * j, x, y, nx, ny, stepX );
+	}
+}
+
+// SSE2
+
+#if defined( FLUID_KERNELS_SSE2 )
+
+static bool cpuHasSse2()
+{
+#if defined( _M_X64 ) || defined( __x86_64__ )
+	return true;
+#elif defined( _MSC_VER )
+	int info[4];
+	__cpuid( info, 1 );
+	return ( info[3] & ( 1 << 26 ) ) != 0;
+#elif defined( __GNUC__ )
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "sse2" );
+#else
+	return false;
+#endif
+}
+
+static inline __m128 absSse( __m128 x )
+{
+	return _mm_and_ps( x, _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) ) );
+}
+
+static inline float horizontalSumSse( __m128 x )
+{
+	float lanes[4];
+	_mm_storeu_ps( lanes, x );
+	return ( lanes[0] + lanes[1] ) + ( lanes[2] + lanes[3] );
+}
+
+static inline float horizontalMaxSse( __m128 x )
+{
+	x = _mm_max_ps( x, _mm_shuffle_ps( x, x, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	x = _mm_max_ps( x, _mm_shuffle_ps( x, x, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	return _mm_cvtss_f32( x );
+}
+
+static inline __m128 loadSse( const float *x )
+{
+	return _mm_loadu_ps( x );
+}
+
+static inline __m128 loadSse( const int16_t *q )
+{
+	__m128i v = _mm_loadl_epi64( reinterpret_cast< const __m128i * >( q ) );
+	__m128i wide = _mm_srai_epi32( _mm_unpacklo_epi16( v, v ), 16 );
+	return _mm_mul_ps( _mm_cvtepi32_ps( wide ), _mm_set1_ps( 1.0f / FLUID_FIXED_ONE ) );
+}
+
+static inline void storeSse( float *x, __m128 f )
+{
+	_mm_storeu_ps( x, f );
+}
+
+// the clamp keeps the conversion in the range of int16_t, which the pack needs too
+static inline __m128 scaleFixedSse( __m128 f )
+{
+	f = _mm_mul_ps( f, _mm_set1_ps( FLUID_FIXED_ONE ) );
+	return _mm_max_ps( _mm_min_ps( f, _mm_set1_ps( 32767.0f ) ), _mm_set1_ps( -32768.0f ) );
+}
+
+static inline void storeSse( int16_t *q, __m128 f )
+{
+	__m128i i = _mm_cvtps_epi32( scaleFixedSse( f ) );
+	_mm_storel_epi64( reinterpret_cast< __m128i * >( q ), _mm_packs_epi32( i, i ) );
+}
+
+static inline void storeFadedSse( float *x, __m128 f, __m128 thresh, int )
+{
+	_mm_storeu_ps( x, _mm_andnot_ps( _mm_cmplt_ps( absSse( f ), thresh ), f ) );
+}
+
+// the same dithered rounding as storeFaded
+static inline void storeFadedSse( int16_t *q, __m128 f, __m128 phase, int i )
+{
+	__m128 index = _mm_add_ps( _mm_set1_ps( (float)i ), _mm_setr_ps( 0, 1, 2, 3 ) );
+	__m128 d = _mm_add_ps( phase, _mm_mul_ps( index, _mm_set1_ps( FLUID_DITHER_STEP ) ) );
+	d = _mm_sub_ps( d, _mm_cvtepi32_ps( _mm_cvttps_epi32( d ) ) );
+	__m128 offset = _mm_set1_ps( 32768.0f );
+	__m128i k = _mm_cvttps_epi32( _mm_add_ps( _mm_add_ps( scaleFixedSse( f ), d ), offset ) );
+	k = _mm_sub_epi32( k, _mm_set1_epi32( 32768 ) );
+	_mm_storel_epi64( reinterpret_cast< __m128i * >( q ), _mm_packs_epi32( k, k ) );
+}
+
+template< typename T >
+static void addSourceSse( T *x, const T *x0, float dt, int n )
+{
+	__m128 vdt = _mm_set1_ps( dt );
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		storeSse( x + i, _mm_add_ps( loadSse( x + i ), _mm_mul_ps( vdt, loadSse( x0 + i ) ) ) );
+	addSourceScalar( x + i, x0 + i, dt, n - i );
+}
+
+template< typename TD, typename TS >
+static void convertSse( TD *d, const TS *s, int n )
+{
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		storeSse( d + i, loadSse( s + i ) );
+	convertScalar( d + i, s + i, n - i );
+}
+
+template< typename T, bool stats >
+static void fadeSseT( T *x, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	__m128 one = _mm_set1_ps( 1.0f );
+	__m128 vhold = _mm_set1_ps( hold );
+	__m128 thresh = _mm_set1_ps( zeroThresh );
+	__m128 s = _mm_setzero_ps();
+	__m128 sq = _mm_setzero_ps();
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		__m128 t = _mm_min_ps( loadSse( x + i ), one );
+		if( stats )
+		{
+			s = _mm_add_ps( s, t );
+			sq = _mm_add_ps( sq, _mm_mul_ps( t, t ) );
+		}
+		storeFadedSse( x + i, _mm_mul_ps( t, vhold ), thresh, i );
+	}
+	if( stats )
+	{
+		*sum += horizontalSumSse( s );
+		*sumSq += horizontalSumSse( sq );
+	}
+	fadeScalarT< T, stats >( x + i, hold, zeroThresh, n - i, sum, sumSq, i );
+}
+
+template< typename T >
+static void fadeSse( T *x, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeSseT< T, true >( x, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeSseT< T, false >( x, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< typename T, bool stats >
+static void fadeRGBSseT( T *r, T *g, T *b, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	__m128 one = _mm_set1_ps( 1.0f );
+	__m128 vhold = _mm_set1_ps( hold );
+	__m128 thresh = _mm_set1_ps( zeroThresh );
+	__m128 s = _mm_setzero_ps();
+	__m128 sq = _mm_setzero_ps();
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		__m128 tr = _mm_min_ps( loadSse( r + i ), one );
+		__m128 tg = _mm_min_ps( loadSse( g + i ), one );
+		__m128 tb = _mm_min_ps( loadSse( b + i ), one );
+		if( stats )
+		{
+			__m128 density = _mm_max_ps( tr, _mm_max_ps( tg, tb ) );
+			s = _mm_add_ps( s, density );
+			sq = _mm_add_ps( sq, _mm_mul_ps( density, density ) );
+		}
+		storeFadedSse( r + i, _mm_mul_ps( tr, vhold ), thresh, i );
+		storeFadedSse( g + i, _mm_mul_ps( tg, vhold ), thresh, i );
+		storeFadedSse( b + i, _mm_mul_ps( tb, vhold ), thresh, i );
+	}
+	if( stats )
+	{
+		*sum += horizontalSumSse( s );
+		*sumSq += horizontalSumSse( sq );
+	}
+	fadeRGBScalarT< T, stats >( r + i, g + i, b + i, hold, zeroThresh, n - i, sum, sumSq, i );
+}
+
+template< typename T >
+static void fadeRGBSse( T *r, T *g, T *b, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeRGBSseT< T, true >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeRGBSseT< T, false >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< bool stats >
+static void flushZeroSseT( float *x, float zeroThresh, int n, float *sumSq )
+{
+	__m128 thresh = _mm_set1_ps( zeroThresh );
+	__m128 sq = _mm_setzero_ps();
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		__m128 v = _mm_loadu_ps( x + i );
+		if( stats )
+			sq = _mm_add_ps( sq, _mm_mul_ps( v, v ) );
+		_mm_storeu_ps( x + i, _mm_andnot_ps( _mm_cmplt_ps( absSse( v ), thresh ), v ) );
+	}
+	if( stats )
+		*sumSq += horizontalSumSse( sq );
+	flushZeroScalarT< stats >( x + i, zeroThresh, n - i, sumSq );
+}
+
+static void flushZeroSse( float *x, float zeroThresh, int n, float *sumSq )
+{
+	if( sumSq )
+		flushZeroSseT< true >( x, zeroThresh, n, sumSq );
+	else
+		flushZeroSseT< false >( x, zeroThresh, n, sumSq );
+}
+
+// the cells of the color being relaxed are every other one and only those are touched in the rows next to this
+// one, which other threads are relaxing at the same time: the neighbours above and below are loaded one by one.
+// in this row the other color is never written, so four cells of the color are taken out of two blocks and
+// stored back one by one
+static inline __m128 loadEvenSse( const float *x )
+{
+	return _mm_shuffle_ps( _mm_loadu_ps( x ), _mm_loadu_ps( x + 4 ), _MM_SHUFFLE( 2, 0, 2, 0 ) );
+}
+
+static inline __m128 loadColorSse( const float *x )
+{
+	return _mm_setr_ps( x[0], x[2], x[4], x[6] );
+}
+
+static float relaxRowSse( float *x, const float *x0, int n, int stepX, float a, float c, int parity )
+{
+	__m128 va = _mm_set1_ps( a );
+	__m128 vc = _mm_set1_ps( c );
+	__m128 delta = _mm_setzero_ps();
+	int k = parity;
+	for( ; k + 7 <= n; k += 8 )
+	{
+		__m128 lo = _mm_loadu_ps( x + k );
+		__m128 hi = _mm_loadu_ps( x + k + 4 );
+		__m128 old = _mm_shuffle_ps( lo, hi, _MM_SHUFFLE( 2, 0, 2, 0 ) );
+		__m128 right = _mm_shuffle_ps( lo, hi, _MM_SHUFFLE( 3, 1, 3, 1 ) );
+		__m128 sum = _mm_add_ps( _mm_add_ps( _mm_add_ps( loadEvenSse( x + k - 1 ), right ),
+											 loadColorSse( x + k - stepX ) ), loadColorSse( x + k + stepX ) );
+		__m128 relaxed = _mm_mul_ps( _mm_add_ps( _mm_mul_ps( sum, va ), loadEvenSse( x0 + k ) ), vc );
+		delta = _mm_max_ps( delta, absSse( _mm_sub_ps( relaxed, old ) ) );
+		_mm_store_ss( x + k, relaxed );
+		_mm_store_ss( x + k + 2, _mm_shuffle_ps( relaxed, relaxed, _MM_SHUFFLE( 1, 1, 1, 1 ) ) );
+		_mm_store_ss( x + k + 4, _mm_shuffle_ps( relaxed, relaxed, _MM_SHUFFLE( 2, 2, 2, 2 ) ) );
+		_mm_store_ss( x + k + 6, _mm_shuffle_ps( relaxed, relaxed, _MM_SHUFFLE( 3, 3, 3, 3 ) ) );
+	}
+
+	float maxDelta = horizontalMaxSse( delta );
+	for( ; k < n; k += 2 )
+	{
+		float old = x[k];
+		x[k] = ( ( x[k-1] + x[k+1] + x[k - stepX] + x[k + stepX] ) * a + x0[k] ) * c;
+		float d = fabsf( x[k] - old );
+		maxDelta = d > maxDelta ? d : maxDelta;
+	}
+	return maxDelta;
+}
+
+static void curlRowSse( float *curl, const float *u, const float *v, int n, int stepX )
+{
+	__m128 half = _mm_set1_ps( 0.5f );
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		__m128 du = _mm_sub_ps( _mm_loadu_ps( u + k + stepX ), _mm_loadu_ps( u + k - stepX ) );
+		__m128 dv = _mm_sub_ps( _mm_loadu_ps( v + k + 1 ), _mm_loadu_ps( v + k - 1 ) );
+		_mm_storeu_ps( curl + k, _mm_mul_ps( _mm_sub_ps( du, dv ), half ) );
+	}
+	curlRowScalar( curl + k, u + k, v + k, n - k, stepX );
+}
+
+// sqrt and division are correctly rounded, so the lanes match vorticityRowScalar exactly
+static void vorticityRowSse( float *fx, float *fy, const float *curl, int n, int stepX )
+{
+	__m128 two = _mm_set1_ps( 2.0f );
+	__m128 epsilon = _mm_set1_ps( 0.000001f );
+	__m128 sign = _mm_set1_ps( -0.0f );
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		__m128 dx = _mm_sub_ps( absSse( _mm_loadu_ps( curl + k + 1 ) ), absSse( _mm_loadu_ps( curl + k - 1 ) ) );
+		__m128 dy = _mm_sub_ps( absSse( _mm_loadu_ps( curl + k + stepX ) ), absSse( _mm_loadu_ps( curl + k - stepX ) ) );
+		__m128 length = _mm_div_ps( two, _mm_add_ps( _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ) ), epsilon ) );
+		__m128 w = _mm_loadu_ps( curl + k );
+		_mm_storeu_ps( fx + k, _mm_mul_ps( _mm_mul_ps( dy, length ), _mm_xor_ps( w, sign ) ) );
+		_mm_storeu_ps( fy + k, _mm_mul_ps( _mm_mul_ps( dx, length ), w ) );
+	}
+	vorticityRowScalar( fx + k, fy + k, curl + k, n - k, stepX );
+}
+
+// four cells at offset from the indices
+template< typename T >
+static inline __m128 gatherSse( const T *src, const int *index, int offset )
+{
+	return _mm_set_ps( loadValue( src[index[3] + offset] ), loadValue( src[index[2] + offset] ),
+					   loadValue( src[index[1] + offset] ), loadValue( src[index[0] + offset] ) );
+}
+
+// fixed point cells are gathered as integers and converted together
+template<>
+inline __m128 gatherSse( const int16_t *src, const int *index, int offset )
+{
+	__m128i q = _mm_set_epi32( src[index[3] + offset], src[index[2] + offset], src[index[1] + offset], src[index[0] + offset] );
+	return _mm_mul_ps( _mm_cvtepi32_ps( q ), _mm_set1_ps( 1.0f / FLUID_FIXED_ONE ) );
+}
+
+// positions of four cells traced back along the velocity, as in advectCell
+struct BacktraceSse {
+	__m128	vdtx, vdty, maxX, maxY, half, one, vstep, vj;
+
+	BacktraceSse( int j, int nx, int ny, int stepX, float dt0x, float dt0y )
+	: vdtx( _mm_set1_ps( dt0x ) ), vdty( _mm_set1_ps( dt0y ) ), maxX( _mm_set1_ps( nx + 0.5f ) ), maxY( _mm_set1_ps( ny + 0.5f ) ),
+	  half( _mm_set1_ps( 0.5f ) ), one( _mm_set1_ps( 1.0f ) ), vstep( _mm_set1_ps( (float)stepX ) ), vj( _mm_set1_ps( (float)j ) )
+	{
+	}
+
+	// index receives the cells above and left of the positions, s1 and t1 the offsets from there
+	inline void trace( __m128 vi, const float *u, const float *v, int *index, __m128 *s1, __m128 *t1 ) const
+	{
+		__m128 x = _mm_sub_ps( vi, _mm_mul_ps( vdtx, _mm_loadu_ps( u ) ) );
+		__m128 y = _mm_sub_ps( vj, _mm_mul_ps( vdty, _mm_loadu_ps( v ) ) );
+		x = _mm_max_ps( _mm_min_ps( x, maxX ), half );
+		y = _mm_max_ps( _mm_min_ps( y, maxY ), half );
+
+		__m128 i0 = _mm_cvtepi32_ps( _mm_cvttps_epi32( x ) );
+		__m128 j0 = _mm_cvtepi32_ps( _mm_cvttps_epi32( y ) );
+		*s1 = _mm_sub_ps( x, i0 );
+		*t1 = _mm_sub_ps( y, j0 );
+
+		// the indices are well below 2^24 so they are exact in float
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( index ), _mm_cvttps_epi32( _mm_add_ps( i0, _mm_mul_ps( vstep, j0 ) ) ) );
+	}
+};
+
+template< typename TD, typename TS >
+static void advectRowSse( TD *const *d, const TS *const *d0, int planes, const float *u, const float *v,
+						  int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y )
+{
+	BacktraceSse backtrace( j, nx, ny, stepX, dt0x, dt0y );
+	__m128 vi = _mm_set_ps( (float)( i0 + 3 ), (float)( i0 + 2 ), (float)( i0 + 1 ), (float)i0 );
+	__m128 four = _mm_set1_ps( 4 );
+
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		int index[4];
+		__m128 s1, t1;
+		backtrace.trace( vi, u + k, v + k, index, &s1, &t1 );
+		__m128 s0 = _mm_sub_ps( backtrace.one, s1 );
+		__m128 t0 = _mm_sub_ps( backtrace.one, t1 );
+
+		for( int p = 0; p < planes; ++p )
+		{
+			__m128 c00 = gatherSse( d0[p], index, 0 );
+			__m128 c01 = gatherSse( d0[p], index, stepX );
+			__m128 c10 = gatherSse( d0[p], index, 1 );
+			__m128 c11 = gatherSse( d0[p], index, stepX + 1 );
+			__m128 result = _mm_add_ps( _mm_mul_ps( s0, _mm_add_ps( _mm_mul_ps( t0, c00 ), _mm_mul_ps( t1, c01 ) ) ),
+										_mm_mul_ps( s1, _mm_add_ps( _mm_mul_ps( t0, c10 ), _mm_mul_ps( t1, c11 ) ) ) );
+			storeSse( d[p] + k, result );
+		}
+
+		vi = _mm_add_ps( vi, four );
+	}
+
+	for( ; k < n; ++k )
+	{
+		float x = ( i0 + k ) - dt0x * u[k];
+		float y = j - dt0y * v[k];
+		advectCell( d, d0, planes, k, x, y, nx, ny, stepX );
+	}
+}
+
+static void sampleVelocitySse( const float *u, const float *v, const float *x, const float *y, float *vx, float *vy,
+							   int n, int nx, int ny, int stepX )
+{
+	__m128 scaleX = _mm_set1_ps( (float)( nx + 2 ) );
+	__m128 scaleY = _mm_set1_ps( (float)( ny + 2 ) );
+	__m128 maxX = _mm_set1_ps( (float)( nx + 1 ) );
+	__m128 maxY = _mm_set1_ps( (float)( ny + 1 ) );
+	__m128 lastX = _mm_set1_ps( (float)nx );
+	__m128 lastY = _mm_set1_ps( (float)ny );
+	__m128 half = _mm_set1_ps( 0.5f );
+	__m128 one = _mm_set1_ps( 1.0f );
+	__m128 vstep = _mm_set1_ps( (float)stepX );
+
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		// the same operations as sampleCell, max and min pick zero and the upper bound for a nan the same way
+		__m128 px = _mm_sub_ps( _mm_mul_ps( _mm_loadu_ps( x + k ), scaleX ), half );
+		__m128 py = _mm_sub_ps( _mm_mul_ps( _mm_loadu_ps( y + k ), scaleY ), half );
+		px = _mm_min_ps( _mm_max_ps( px, _mm_setzero_ps() ), maxX );
+		py = _mm_min_ps( _mm_max_ps( py, _mm_setzero_ps() ), maxY );
+
+		__m128 i0 = _mm_min_ps( _mm_cvtepi32_ps( _mm_cvttps_epi32( px ) ), lastX );
+		__m128 j0 = _mm_min_ps( _mm_cvtepi32_ps( _mm_cvttps_epi32( py ) ), lastY );
+		__m128 s1 = _mm_sub_ps( px, i0 );
+		__m128 t1 = _mm_sub_ps( py, j0 );
+		__m128 s0 = _mm_sub_ps( one, s1 );
+		__m128 t0 = _mm_sub_ps( one, t1 );
+
+		int index[4];
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( index ), _mm_cvttps_epi32( _mm_add_ps( i0, _mm_mul_ps( vstep, j0 ) ) ) );
+
+		const float *planes[2] = { u, v };
+		float *results[2] = { vx, vy };
+		for( int p = 0; p < 2; ++p )
+		{
+			__m128 c00 = gatherSse( planes[p], index, 0 );
+			__m128 c01 = gatherSse( planes[p], index, stepX );
+			__m128 c10 = gatherSse( planes[p], index, 1 );
+			__m128 c11 = gatherSse( planes[p], index, stepX + 1 );
+			_mm_storeu_ps( results[p] + k, _mm_add_ps( _mm_mul_ps( s0, _mm_add_ps( _mm_mul_ps( t0, c00 ), _mm_mul_ps( t1, c01 ) ) ),
+													  _mm_mul_ps( s1, _mm_add_ps( _mm_mul_ps( t0, c10 ), _mm_mul_ps( t1, c11 ) ) ) ) );
+		}
+	}
+	sampleVelocityScalar( u, v, x + k, y + k, vx + k, vy + k, n - k, nx, ny, stepX );
+}
+
+template< typename T >
+static void maccormackRowSse( T *const *d, const T *const *d0, const float *const *back, int planes, const float *u, const float *v,
+							  int i0, int j, int n, int nx, int ny, int stepX, float dt0x, float dt0y )
+{
+	BacktraceSse backtrace( j, nx, ny, stepX, dt0x, dt0y );
+	__m128 vi = _mm_set_ps( (float)( i0 + 3 ), (float)( i0 + 2 ), (float)( i0 + 1 ), (float)i0 );
+	__m128 four = _mm_set1_ps( 4 );
+	int cell = i0 + stepX * j;
+
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		int index[4];
+		__m128 s1, t1;
+		backtrace.trace( vi, u + k, v + k, index, &s1, &t1 );
+
+		for( int p = 0; p < planes; ++p )
+		{
+			__m128 c00 = gatherSse( d0[p], index, 0 );
+			__m128 c01 = gatherSse( d0[p], index, stepX );
+			__m128 c10 = gatherSse( d0[p], index, 1 );
+			__m128 c11 = gatherSse( d0[p], index, stepX + 1 );
+			__m128 lo = _mm_min_ps( _mm_min_ps( c00, c01 ), _mm_min_ps( c10, c11 ) );
+			__m128 hi = _mm_max_ps( _mm_max_ps( c00, c01 ), _mm_max_ps( c10, c11 ) );
+			__m128 error = _mm_sub_ps( loadSse( d0[p] + cell + k ), _mm_loadu_ps( back[p] + k ) );
+			__m128 corrected = _mm_add_ps( loadSse( d[p] + k ), _mm_mul_ps( backtrace.half, error ) );
+			storeSse( d[p] + k, _mm_max_ps( _mm_min_ps( corrected, hi ), lo ) );
+		}
+
+		vi = _mm_add_ps( vi, four );
+	}
+
+	for( ; k < n; ++k )
+	{
+		float x = ( i0 + k ) - dt0x * u[k];
+		float y = j - dt0y * v[k];
+		maccormackCell( d, d0, back, planes, k, cell + k, x, y, nx, ny, stepX );
+	}
+}
+
+#endif // FLUID_KERNELS_SSE2
+
+// NEON
+
+#if defined( FLUID_KERNELS_NEON )
+
+static inline float horizontalSumNeon( float32x4_t x )
+{
+	return ( vgetq_lane_f32( x, 0 ) + vgetq_lane_f32( x, 1 ) ) + ( vgetq_lane_f32( x, 2 ) + vgetq_lane_f32( x, 3 ) );
+}
+
+static inline float horizontalMaxNeon( float32x4_t x )
+{
+	float a = vgetq_lane_f32( x, 0 ) > vgetq_lane_f32( x, 1 ) ? vgetq_lane_f32( x, 0 ) : vgetq_lane_f32( x, 1 );
+	float b = vgetq_lane_f32( x, 2 ) > vgetq_lane_f32( x, 3 ) ? vgetq_lane_f32( x, 2 ) : vgetq_lane_f32( x, 3 );
+	return a > b ? a : b;
+}
+
+// zeroes the lanes of f with an absolute value below thresh
+static inline float32x4_t flushNeon( float32x4_t f, float32x4_t thresh )
+{
+	return vbslq_f32( vcltq_f32( vabsq_f32( f ), thresh ), vdupq_n_f32( 0 ), f );
+}
+
+static void addSourceNeon( float *x, const float *x0, float dt, int n )
+{
+	float32x4_t vdt = vdupq_n_f32( dt );
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+		vst1q_f32( x + i, vaddq_f32( vld1q_f32( x + i ), vmulq_f32( vdt, vld1q_f32( x0 + i ) ) ) );
+	addSourceScalar( x + i, x0 + i, dt, n - i );
+}
+
+template< bool stats >
+static void fadeNeonT( float *x, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	float32x4_t one = vdupq_n_f32( 1.0f );
+	float32x4_t vhold = vdupq_n_f32( hold );
+	float32x4_t thresh = vdupq_n_f32( zeroThresh );
+	float32x4_t s = vdupq_n_f32( 0 );
+	float32x4_t sq = vdupq_n_f32( 0 );
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		float32x4_t t = vminq_f32( vld1q_f32( x + i ), one );
+		if( stats )
+		{
+			s = vaddq_f32( s, t );
+			sq = vaddq_f32( sq, vmulq_f32( t, t ) );
+		}
+		vst1q_f32( x + i, flushNeon( vmulq_f32( t, vhold ), thresh ) );
+	}
+	if( stats )
+	{
+		*sum += horizontalSumNeon( s );
+		*sumSq += horizontalSumNeon( sq );
+	}
+	fadeScalarT< float, stats >( x + i, hold, zeroThresh, n - i, sum, sumSq );
+}
+
+static void fadeNeon( float *x, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeNeonT< true >( x, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeNeonT< false >( x, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< bool stats >
+static void fadeRGBNeonT( float *r, float *g, float *b, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	float32x4_t one = vdupq_n_f32( 1.0f );
+	float32x4_t vhold = vdupq_n_f32( hold );
+	float32x4_t thresh = vdupq_n_f32( zeroThresh );
+	float32x4_t s = vdupq_n_f32( 0 );
+	float32x4_t sq = vdupq_n_f32( 0 );
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		float32x4_t tr = vminq_f32( vld1q_f32( r + i ), one );
+		float32x4_t tg = vminq_f32( vld1q_f32( g + i ), one );
+		float32x4_t tb = vminq_f32( vld1q_f32( b + i ), one );
+		if( stats )
+		{
+			float32x4_t density = vmaxq_f32( tr, vmaxq_f32( tg, tb ) );
+			s = vaddq_f32( s, density );
+			sq = vaddq_f32( sq, vmulq_f32( density, density ) );
+		}
+		vst1q_f32( r + i, flushNeon( vmulq_f32( tr, vhold ), thresh ) );
+		vst1q_f32( g + i, flushNeon( vmulq_f32( tg, vhold ), thresh ) );
+		vst1q_f32( b + i, flushNeon( vmulq_f32( tb, vhold ), thresh ) );
+	}
+	if( stats )
+	{
+		*sum += horizontalSumNeon( s );
+		*sumSq += horizontalSumNeon( sq );
+	}
+	fadeRGBScalarT< float, stats >( r + i, g + i, b + i, hold, zeroThresh, n - i, sum, sumSq );
+}
+
+static void fadeRGBNeon( float *r, float *g, float *b, float hold, float zeroThresh, int n, float *sum, float *sumSq )
+{
+	if( sum )
+		fadeRGBNeonT< true >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+	else
+		fadeRGBNeonT< false >( r, g, b, hold, zeroThresh, n, sum, sumSq );
+}
+
+template< bool stats >
+static void flushZeroNeonT( float *x, float zeroThresh, int n, float *sumSq )
+{
+	float32x4_t thresh = vdupq_n_f32( zeroThresh );
+	float32x4_t sq = vdupq_n_f32( 0 );
+	int i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		float32x4_t v = vld1q_f32( x + i );
+		if( stats )
+			sq = vaddq_f32( sq, vmulq_f32( v, v ) );
+		vst1q_f32( x + i, flushNeon( v, thresh ) );
+	}
+	if( stats )
+		*sumSq += horizontalSumNeon( sq );
+	flushZeroScalarT< stats >( x + i, zeroThresh, n - i, sumSq );
+}
+
+static void flushZeroNeon( float *x, float zeroThresh, int n, float *sumSq )
+{
+	if( sumSq )
+		flushZeroNeonT< true >( x, zeroThresh, n, sumSq );
+	else
+		flushZeroNeonT< false >( x, zeroThresh, n, sumSq );
+}
+
+static inline float32x4_t loadColorNeon( const float *x )
+{
+	float32x4_t r = vdupq_n_f32( x[0] );
+	r = vld1q_lane_f32( x + 2, r, 1 );
+	r = vld1q_lane_f32( x + 4, r, 2 );
+	return vld1q_lane_f32( x + 6, r, 3 );
+}
+
+// see relaxRowSse, the structure loads split the cells of this row by color
+static float relaxRowNeon( float *x, const float *x0, int n, int stepX, float a, float c, int parity )
+{
+	float32x4_t va = vdupq_n_f32( a );
+	float32x4_t vc = vdupq_n_f32( c );
+	float32x4_t delta = vdupq_n_f32( 0 );
+	int k = parity;
+	for( ; k + 7 <= n; k += 8 )
+	{
+		float32x4x2_t cells = vld2q_f32( x + k );
+		float32x4_t sum = vaddq_f32( vaddq_f32( vaddq_f32( vld2q_f32( x + k - 1 ).val[0], cells.val[1] ),
+												loadColorNeon( x + k - stepX ) ), loadColorNeon( x + k + stepX ) );
+		float32x4_t relaxed = vmulq_f32( vaddq_f32( vmulq_f32( sum, va ), vld2q_f32( x0 + k ).val[0] ), vc );
+		delta = vmaxq_f32( delta, vabsq_f32( vsubq_f32( relaxed, cells.val[0] ) ) );
+		vst1q_lane_f32( x + k, relaxed, 0 );
+		vst1q_lane_f32( x + k + 2, relaxed, 1 );
+		vst1q_lane_f32( x + k + 4, relaxed, 2 );
+		vst1q_lane_f32( x + k + 6, relaxed, 3 );
+	}
+
+	float maxDelta = horizontalMaxNeon( delta );
+	for( ; k < n; k += 2 )
+	{
+		float old = x[k];
+		x[k] = ( ( x[k-1] + x[k+1] + x[k - stepX] + x[k + stepX] ) * a + x0[k] ) * c;
+		float d = fabsf( x[k] - old );
+		maxDelta = d > maxDelta ? d : maxDelta;
+	}
+	return maxDelta;
+}
+
+static void curlRowNeon( float *curl, const float *u, const float *v, int n, int stepX )
+{
+	float32x4_t half = vdupq_n_f32( 0.5f );
+	int k = 0;
+	for( ; k + 4 <= n; k += 4 )
+	{
+		float32x4_t du = vsubq_f32( vld1q_f32( u + k + stepX ), vld1q_f32( u + k - stepX ) );
+		float32x4_t dv = vsubq_f32( vld1q_f32( v + k + 1 ), vld1q_f32( v + k - 1 ) );
+		vst1q_f32( curl + k, vmulq_f32( vsubq_f32( du, dv ), half ) );
+	}
+	curlRowScalar( curl + k, u + k, v + k, n - k, stepX );
+}
+
+#endif // FLUID_KERNELS_NEON
+
+static const ciMsaFluidKernels sScalarKernels =
+{
+	"scalar",
+	addSourceScalar< float >,
+	fadeScalar< float >,
+	fadeRGBScalar< float >,
+	flushZeroScalar,
+	relaxRowScalar,
+	advectRowScalar< float, float >,
+	maccormackRowScalar< float >,
+	addSourceScalar< int16_t >,
+	fadeScalar< int16_t >,
+	fadeRGBScalar< int16_t >,
+	advectRowScalar< int16_t, int16_t >,
+	advectRowScalar< float, int16_t >,
+	maccormackRowScalar< int16_t >,
+	convertScalar< int16_t, float >,
+	convertScalar< float, int16_t >,
+	sampleVelocityScalar,
+	curlRowScalar,
+	vorticityRowScalar
+};
+
+#if defined( FLUID_KERNELS_SSE2 )
+static const ciMsaFluidKernels sSimdKernels =
+{
+	"sse2",
+	addSourceSse< float >,
+	fadeSse< float >,
+	fadeRGBSse< float >,
+	flushZeroSse,
+	relaxRowSse,
+	advectRowSse< float, float >,
+	maccormackRowSse< float >,
+	addSourceSse< int16_t >,
+	fadeSse< int16_t >,
+	fadeRGBSse< int16_t >,
+	advectRowSse< int16_t, int16_t >,
+	advectRowSse< float, int16_t >,
+	maccormackRowSse< int16_t >,
+	convertSse< int16_t, float >,
+	convertSse< float, int16_t >,
+	sampleVelocitySse,
+	curlRowSse,
+	vorticityRowSse
+};
+#elif defined( FLUID_KERNELS_NEON )
+// the gathers of the advection and the velocity sampling have no neon equivalent, they stay scalar.
+// so does the fixed point color, and the vorticity force as armv7 has no exact division or square root
+static const ciMsaFluidKernels sSimdKernels =
+{
+	"neon",
+	addSourceNeon,
+	fadeNeon,
+	fadeRGBNeon,
+	flushZeroNeon,
+	relaxRowNeon,
+	advectRowScalar< float, float >,
+	maccormackRowScalar< float >,
+	addSourceScalar< int16_t >,
+	fadeScalar< int16_t >,
+	fadeRGBScalar< int16_t >,
+	advectRowScalar< int16_t, int16_t >,
+	advectRowScalar< float, int16_t >,
+	maccormackRowScalar< int16_t >,
+	convertScalar< int16_t, float >,
+	convertScalar< float, int16_t >,
+	sampleVelocityScalar,
+	curlRowNeon,
+	vorticityRowScalar
+};
+#endif
+
+const ciMsaFluidKernels* ciMsaFluidKernels::getScalar()
+{
+	return &sScalarKernels;
+}
+
+const ciMsaFluidKernels* ciMsaFluidKernels::getBest()
+{
+#if defined( FLUID_KERNELS_SSE2 )
+	static const bool hasSse2 = cpuHasSse2();
+	return hasSse2 ? &sSimdKernels : &sScalarKernels;
+#elif defined( FLUID_KERNELS_NEON )
+	return &sSimdKernels;
+#else
+	return &sScalarKernels;
+#endif
+}
+
+// Denormals
+
+#if defined( FLUID_KERNELS_SSE2 )
+	#if defined( _M_X64 ) || defined( __x86_64__ )
+		#define FLUID_DENORMAL_BITS	0x8040	// ftz and daz of the mxcsr
+	#else
+		#define FLUID_DENORMAL_BITS	0x8000	// ftz only
+	#endif
+static inline unsigned getFloatMode() { return _mm_getcsr(); }
+static inline void setFloatMode( unsigned mode ) { _mm_setcsr( mode ); }
+#elif defined( FLUID_KERNELS_NEON ) && defined( __aarch64__ )
+	#define FLUID_DENORMAL_BITS	( 1u << 24 )	// fz of the fpcr, covers inputs as well
+static inline unsigned getFloatMode()
+{
+	uint64_t fpcr;
+	__asm__ __volatile__( "mrs %0, fpcr" : "=r"( fpcr ) );
+	return (unsigned)fpcr;
+}
+static inline void setFloatMode( unsigned mode )
+{
+	uint64_t fpcr = mode;
+	__asm__ __volatile__( "msr fpcr, %0" : : "r"( fpcr ) );
+}
+#elif defined( FLUID_KERNELS_NEON ) && defined( __GNUC__ )
+	#define FLUID_DENORMAL_BITS	( 1u << 24 )	// fz of the fpscr for vfp, neon always flushes
+static inline unsigned getFloatMode()
+{
+	unsigned fpscr;
+	__asm__ __volatile__( "vmrs %0, fpscr" : "=r"( fpscr ) );
+	return fpscr;
+}
+static inline void setFloatMode( unsigned mode )
+{
+	__asm__ __volatile__( "vmsr fpscr, %0" : : "r"( mode ) );
+}
+#else
+	#define FLUID_DENORMAL_BITS	0
+static inline unsigned getFloatMode() { return 0; }
+static inline void setFloatMode( unsigned ) {}
+#endif
+
+ciMsaFluidDenormalGuard::ciMsaFluidDenormalGuard( bool enable )
+:saved( getFloatMode() )
+,active( enable && ( saved & FLUID_DENORMAL_BITS ) != FLUID_DENORMAL_BITS )
+{
+	// nested guards find the bits set and leave the mode alone
+	if( active )
+		setFloatMode( saved | FLUID_DENORMAL_BITS );
+}
+
+ciMsaFluidDenormalGuard::~ciMsaFluidDenormalGuard()
+{
+	if( active )
+		setFloatMode( saved );
+}
+
+bool ciMsaFluidDenormalGuard::isEnabled()
+{
+	return FLUID_DENORMAL_BITS != 0 && ( getFloatMode() & FLUID_DENORMAL_BITS ) == FLUID_DENORMAL_BITS;
+}
@@ -44,21 +44,66 @@
 
  /* Portions Copyright (c) 2010, The Cinder Project, http://libcinder.org */
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if defined( _MSC_VER )
+	#include <malloc.h>
+#endif
+
 #include "ciMsaFluidSolver.h"
 #include "cinder/Rand.h"
 
 ciMsaFluidSolver::ciMsaFluidSolver()
-:r(NULL)
+:arena(NULL)
+,arenaCapacity(0)
+,arenaSize(0)
+,r(NULL)
 ,rOld(NULL)
 ,g(NULL)
 ,gOld(NULL)
 ,b(NULL)
 ,bOld(NULL)
-,uv(NULL)
-,uvOld(NULL)
+,rFixed(NULL)
+,rFixedOld(NULL)
+,gFixed(NULL)
+,gFixedOld(NULL)
+,bFixed(NULL)
+,bFixedOld(NULL)
+,doFixedColor(false)
+,ditherPhase(0)
+,u(NULL)
+,v(NULL)
+,uOld(NULL)
+,vOld(NULL)
 ,curl(NULL)
+,advectionMethod(ADVECTION_SEMI_LAGRANGIAN)
+,solverMethod(SOLVER_GAUSS_SEIDEL)
+,projectionMethod(PROJECTION_RELAXATION)
+,multigridCycles(FLUID_DEFAULT_MULTIGRID_CYCLES)
+,projectionResidual(0)
+,solverTolerance(0)
+,solverIterationsUsed(0)
+,solverChange(0)
+,doActiveTiles(false)
+,activeThreshold(FLUID_DEFAULT_ACTIVE_THRESHOLD)
+,tilesX(0)
+,tilesY(0)
+,numActiveTiles(0)
+,doStageTimes(false)
+,kernels(ciMsaFluidKernels::getBest())
+,doFlushDenormals(true)
+,_planeSize(0)
 ,_isInited(false)
+,_avgDensity(0)
+,_uniformity(1)
+,_avgSpeed(0)
+,doStats(true)
+,doCacheBlocking(false)
 {
+	scratch[0] = scratch[1] = scratch[2] = NULL;
+	resetStageTimes();
 }
 
 ciMsaFluidSolver& ciMsaFluidSolver::setSize(int NX, int NY)
@@ -66,6 +111,10 @@ ciMsaFluidSolver& ciMsaFluidSolver::setSize(int NX, int NY)
 	_NX = NX;
 	_NY = NY;
 	_numCells = (_NX + 2) * (_NY + 2);
+	_rowStride = ( _NX + 2 + FLUID_ROW_ALIGN - 1 ) / FLUID_ROW_ALIGN * FLUID_ROW_ALIGN;
+	_planeSize = _rowStride * (_NY + 2);
+	tilesX = ( _NX + FLUID_TILE_SIZE - 1 ) / FLUID_TILE_SIZE;
+	tilesY = ( _NY + FLUID_TILE_SIZE - 1 ) / FLUID_TILE_SIZE;
 	
 	_invNX = 1.0f / _NX;
 	_invNY = 1.0f / _NY;
@@ -111,6 +160,173 @@ ciMsaFluidSolver&  ciMsaFluidSolver::setSolverIterations(int solverIterations) {
 	return *this;	
 }
 
+ciMsaFluidSolver&  ciMsaFluidSolver::setSolverTolerance( float tolerance ) {
+	solverTolerance = tolerance;
+	return *this;
+}
+
+float ciMsaFluidSolver::getSolverTolerance() const {
+	return solverTolerance;
+}
+
+int ciMsaFluidSolver::getSolverIterationsUsed() const {
+	return solverIterationsUsed;
+}
+
+float ciMsaFluidSolver::getSolverChange() const {
+	return solverChange;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setSolverMethod( SolverMethod method ) {
+	solverMethod = method;
+	return *this;
+}
+
+ciMsaFluidSolver::SolverMethod ciMsaFluidSolver::getSolverMethod() const {
+	return solverMethod;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setProjectionMethod( ProjectionMethod method ) {
+	projectionMethod = method;
+	return *this;
+}
+
+ciMsaFluidSolver::ProjectionMethod ciMsaFluidSolver::getProjectionMethod() const {
+	return projectionMethod;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setAdvectionMethod( AdvectionMethod method ) {
+	advectionMethod = method;
+	arrangeScratch();
+	return *this;
+}
+
+ciMsaFluidSolver::AdvectionMethod ciMsaFluidSolver::getAdvectionMethod() const {
+	return advectionMethod;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setMultigridCycles( int cycles ) {
+	multigridCycles = cycles;
+	return *this;
+}
+
+float ciMsaFluidSolver::getProjectionResidual() const {
+	return projectionResidual;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::setNumThreads( int numThreads ) {
+	threadPool.setNumThreads( numThreads );
+	return *this;
+}
+
+int ciMsaFluidSolver::getNumThreads() const {
+	return threadPool.getNumThreads();
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableSimd( bool b ) {
+	kernels = b ? ciMsaFluidKernels::getBest() : ciMsaFluidKernels::getScalar();
+	return *this;
+}
+
+const char* ciMsaFluidSolver::getSimdName() const {
+	return kernels->name;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableDenormalFlush( bool b ) {
+	doFlushDenormals = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getDenormalFlush() const {
+	return doFlushDenormals;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableActiveTiles( bool b, float threshold ) {
+	// the cells of a tile are only known to be clear once it has been found at rest
+	if( b && !doActiveTiles )
+		activeTiles.assign( activeTiles.size(), 1 );
+	doActiveTiles = b;
+	activeThreshold = threshold;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getActiveTiles() const {
+	return doActiveTiles;
+}
+
+int ciMsaFluidSolver::getNumActiveTiles() const {
+	return numActiveTiles;
+}
+
+int ciMsaFluidSolver::getNumTiles() const {
+	return tilesX * tilesY;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableCacheBlocking( bool b ) {
+	doCacheBlocking = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getCacheBlocking() const {
+	return doCacheBlocking;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableStats( bool b ) {
+	doStats = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getStats() const {
+	return doStats;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableFixedColor( bool b ) {
+	if( b != doFixedColor && _isInited )
+		arrangePlanes( b, advectionMethod == ADVECTION_MACCORMACK || ( b && colorDiffusion != 0 ), true );
+	doFixedColor = b;
+	return *this;
+}
+
+bool ciMsaFluidSolver::getFixedColor() const {
+	return doFixedColor;
+}
+
+ciMsaFluidSolver&  ciMsaFluidSolver::enableStageTimes( bool b ) {
+	doStageTimes = b;
+	return *this;
+}
+
+void ciMsaFluidSolver::resetStageTimes() {
+	for( int i = 0; i < STAGE_COUNT; ++i )
+	{
+		stageTimes[i] = 0;
+		stageCalls[i] = 0;
+	}
+}
+
+double ciMsaFluidSolver::getStageTime( Stage stage ) const {
+	return stageTimes[ stage ];
+}
+
+int ciMsaFluidSolver::getStageCalls( Stage stage ) const {
+	return stageCalls[ stage ];
+}
+
+const char* ciMsaFluidSolver::getStageName( Stage stage ) {
+	static const char *names[ STAGE_COUNT ] = { "splat", "addSource", "vorticity", "diffuse", "project", "advect", "fade" };
+	return names[ stage ];
+}
+
+// adds the time since the previous stage ended to stage
+void ciMsaFluidSolver::endStage( Stage stage ) {
+	if( !doStageTimes )
+		return;
+	double now = stageTimer.getSeconds();
+	stageTimes[ stage ] += now - stageStart;
+	++stageCalls[ stage ];
+	stageStart = now;
+}
+
 
 // whether fluid is RGB or monochrome (if only pressure / velocity is needed no need to update 3 channels)
 ciMsaFluidSolver&  ciMsaFluidSolver::enableRGB(bool doRGB) {
@@ -119,6 +335,9 @@ ciMsaFluidSolver&  ciMsaFluidSolver::enableRGB(bool doRGB) {
 }
 
 ciMsaFluidSolver&  ciMsaFluidSolver::enableVorticityConfinement(bool b) {
+	// the full grid ran while it was on, the tiles are found at rest again from scratch
+	if( !b && doVorticityConfinement )
+		activeTiles.assign( activeTiles.size(), 1 );
 	doVorticityConfinement = b;
 	return *this;
 }
@@ -137,51 +356,248 @@ bool ciMsaFluidSolver::isInited() const {
 	return _isInited;
 }
 
+// bytes of a plane of n values of the given size, rounded up so the next plane starts aligned too
+static size_t alignedPlaneBytes( int n, size_t valueSize )
+{
+	size_t alignment = FLUID_ROW_ALIGN * sizeof(float);
+	return ( n * valueSize + alignment - 1 ) / alignment * alignment;
+}
+
+// allocates size zeroed bytes aligned to FLUID_ROW_ALIGN floats so every row of a plane starts aligned
+static void* allocAligned( size_t bytes )
+{
+	size_t alignment = FLUID_ROW_ALIGN * sizeof(float);
+#if defined( _MSC_VER )
+	void *mem = _aligned_malloc( bytes, alignment );
+#else
+	void *mem = NULL;
+	if( posix_memalign( &mem, alignment, bytes ) != 0 )
+		mem = NULL;
+#endif
+	if( !mem )
+		throw std::bad_alloc();
+	memset( mem, 0, bytes );
+	return mem;
+}
+
+static void freeAligned( void *mem )
+{
+#if defined( _MSC_VER )
+	_aligned_free( mem );
+#else
+	free( mem );
+#endif
+}
+
 ciMsaFluidSolver::~ciMsaFluidSolver() {
 	destroy();
 }
 
 void ciMsaFluidSolver::destroy() {
 	_isInited = false;
-	
-	if(r)		delete []r;
-	if(rOld)	delete []rOld;
-	
-	if(g)		delete []g;
-	if(gOld)	delete []gOld;
-	
-	if(b)		delete []b;
-	if(bOld)	delete []bOld;
-	
-	if(uv)		delete []uv;
-	if(uvOld)	delete []uvOld;
-	if(curl)       delete []curl;
+	freeAligned( arena );
+	arena = NULL;
+	arenaCapacity = arenaSize = 0;
+	setPlanes( NULL, NULL, NULL, NULL );
 }
 
 
 void ciMsaFluidSolver::reset() {
-	destroy();
 	_isInited = true;
+	{
+		std::lock_guard< std::mutex > lock( splatMutex );
+		splatQueue.clear();
+	}
+	multigridLevels.clear();
+	activeTiles.assign( tilesX * tilesY, 0 );
+	numActiveTiles = 0;
+	arrangePlanes( doFixedColor, needsScratch(), false );
+}
+
+bool ciMsaFluidSolver::needsScratch() const {
+	return advectionMethod == ADVECTION_MACCORMACK || ( doFixedColor && colorDiffusion != 0 );
+}
+
+// adds the scratch planes once a setting needs them, they stay until the next reset
+void ciMsaFluidSolver::arrangeScratch() {
+	if( _isInited && needsScratch() && !scratch[0] )
+		arrangePlanes( doFixedColor, true, true );
+}
+
+// points the planes at the arena, velocity and curl first, then the color in either format and the
+// scratch planes. any part passed as NULL is left out and its pointers set to NULL
+void ciMsaFluidSolver::setPlanes( char *velocity, char *color, char *fixedColor, char *scratchPlanes ) {
+	size_t floatBytes = alignedPlaneBytes( _planeSize, sizeof(float) );
+	size_t fixedBytes = alignedPlaneBytes( _planeSize, sizeof(int16_t) );
+	
+	float **velocityPlanes[] = { &u, &v, &uOld, &vOld, &curl };
+	for( int p = 0; p < 5; ++p )
+		*velocityPlanes[p] = velocity ? (float*)( velocity + p * floatBytes ) : NULL;
+	
+	float **colorPlanes[] = { &r, &rOld, &g, &gOld, &b, &bOld };
+	int16_t **fixedPlanes[] = { &rFixed, &rFixedOld, &gFixed, &gFixedOld, &bFixed, &bFixedOld };
+	for( int p = 0; p < 6; ++p )
+	{
+		*colorPlanes[p] = color ? (float*)( color + p * floatBytes ) : NULL;
+		*fixedPlanes[p] = fixedColor ? (int16_t*)( fixedColor + p * fixedBytes ) : NULL;
+	}
+	
+	for( int p = 0; p < 3; ++p )
+		scratch[p] = scratchPlanes ? (float*)( scratchPlanes + p * floatBytes ) : NULL;
+}
+
+// lays out the planes for the color format in the arena. without keep the planes are cleared and the
+// arena is reused as long as it is large enough, so a reset or a resize to the same or a smaller grid
+// allocates nothing. with keep the planes move to a new arena, converting the color if the format changes
+void ciMsaFluidSolver::arrangePlanes( bool fixedColor, bool withScratch, bool keep ) {
+	size_t floatBytes = alignedPlaneBytes( _planeSize, sizeof(float) );
+	size_t fixedBytes = alignedPlaneBytes( _planeSize, sizeof(int16_t) );
+	size_t velocityBytes = 5 * floatBytes;
+	size_t colorBytes = fixedColor ? 6 * fixedBytes : 6 * floatBytes;
+	size_t scratchBytes = withScratch ? 3 * floatBytes : 0;
+	size_t bytes = velocityBytes + colorBytes + scratchBytes;
+	
+	char *mem = arena;
+	if( keep || bytes > arenaCapacity )
+		mem = (char*)allocAligned( bytes );
+	else
+		memset( mem, 0, bytes );
+	
+	if( keep )
+	{
+		memcpy( mem, u, velocityBytes );
+		char *color = mem + velocityBytes;
+		float *colorPlanes[] = { r, rOld, g, gOld, b, bOld };
+		int16_t *fixedPlanes[] = { rFixed, rFixedOld, gFixed, gFixedOld, bFixed, bFixedOld };
+		for( int p = 0; p < 6; ++p )
+		{
+			if( fixedColor && doFixedColor )
+				memcpy( color + p * fixedBytes, fixedPlanes[p], fixedBytes );
+			else if( fixedColor )
+				kernels->toFixed( (int16_t*)( color + p * fixedBytes ), colorPlanes[p], _planeSize );
+			else if( doFixedColor )
+				kernels->fromFixed( (float*)( color + p * floatBytes ), fixedPlanes[p], _planeSize );
+			else
+				memcpy( color + p * floatBytes, colorPlanes[p], floatBytes );
+		}
+	}
+	
+	if( mem != arena )
+	{
+		freeAligned( arena );
+		arena = mem;
+		arenaCapacity = bytes;
+	}
+	arenaSize = bytes;
 	
-	r    = new float[_numCells];
-	rOld = new float[_numCells];
+	char *color = arena + velocityBytes;
+	setPlanes( arena, fixedColor ? NULL : color, fixedColor ? color : NULL, withScratch ? color + colorBytes : NULL );
+}
+
+ciMsaFluidSolver& ciMsaFluidSolver::resize( int NX, int NY )
+{
+	if( !_isInited )
+		return setSize( NX, NY );
+	if( NX == _NX && NY == _NY )
+		return *this;
 	
-	g    = new float[_numCells];
-	gOld = new float[_numCells];
+	// takes the old planes out of the arena so setSize lays out the new ones elsewhere
+	char *oldArena = arena;
+	arena = NULL;
+	arenaCapacity = 0;
+	int oldNX = _NX;
+	int oldNY = _NY;
+	int oldStride = _rowStride;
+	int oldPlaneSize = _planeSize;
+	float *oldVelocity[] = { u, v, uOld, vOld };
+	float *oldColor[] = { r, rOld, g, gOld, b, bOld };
+	int16_t *oldFixed[] = { rFixed, rFixedOld, gFixed, gFixedOld, bFixed, bFixedOld };
 	
-	b    = new float[_numCells];
-	bOld = new float[_numCells];
+	std::vector< Splat > queued;
+	{
+		std::lock_guard< std::mutex > lock( splatMutex );
+		queued.swap( splatQueue );
+	}
+	setSize( NX, NY );
+	{
+		std::lock_guard< std::mutex > lock( splatMutex );
+		splatQueue.insert( splatQueue.begin(), queued.begin(), queued.end() );
+	}
 	
-	uv    = new ci::Vec2f[_numCells];
-	uvOld = new ci::Vec2f[_numCells];
-	curl = new float[_numCells];
+	// the old planes keep the sources not added yet as well
+	float *velocity[] = { u, v, uOld, vOld };
+	resamplePlanes( velocity, oldVelocity, 4, oldNX, oldNY, oldStride );
+	if( doFixedColor )
+	{
+		// resampled in float, it is rare enough not to need a fixed point version
+		std::vector< float > from( 6 * oldPlaneSize );
+		std::vector< float > to( 6 * _planeSize );
+		float *fromPlanes[6], *toPlanes[6];
+		for( int p = 0; p < 6; ++p )
+		{
+			fromPlanes[p] = &from[ p * oldPlaneSize ];
+			toPlanes[p] = &to[ p * _planeSize ];
+			kernels->fromFixed( fromPlanes[p], oldFixed[p], oldPlaneSize );
+		}
+		resamplePlanes( toPlanes, fromPlanes, 6, oldNX, oldNY, oldStride );
+		int16_t *fixed[] = { rFixed, rFixedOld, gFixed, gFixedOld, bFixed, bFixedOld };
+		for( int p = 0; p < 6; ++p )
+			kernels->toFixed( fixed[p], toPlanes[p], _planeSize );
+	}
+	else
+	{
+		float *color[] = { r, rOld, g, gOld, b, bOld };
+		resamplePlanes( color, oldColor, 6, oldNX, oldNY, oldStride );
+	}
+	freeAligned( oldArena );
 	
-	for ( int i = _numCells-1; i>=0; --i )
+	// fluid may have landed in any tile
+	activeTiles.assign( activeTiles.size(), 1 );
+	return *this;
+}
+
+// samples planes of the old grid bilinearly at the centers of the cells of this one, boundary cells included.
+// the positions map the interior of one grid onto the other, so the fluid stays in place whatever the size
+void ciMsaFluidSolver::resamplePlanes( float *const *dst, const float *const *src, int planes, int srcNX, int srcNY, int srcStride )
+{
+	int n = _NX + 2;
+	std::vector< float > x( n ), y( n ), unused( n );
+	for( int i = 0; i < n; ++i )
+		x[i] = ( ( i - 0.5f ) * _invNX * srcNX + 1 ) / ( srcNX + 2 );
+	for( int j = 0; j < _NY + 2; ++j )
 	{
-		uv[i] = uvOld[i] = ci::Vec2f::zero();
-		curl[i] = 0.0f;
-		r[i] = rOld[i] = g[i] = gOld[i] = b[i] = bOld[i] = 0;
+		std::fill( y.begin(), y.end(), ( ( j - 0.5f ) * _invNY * srcNY + 1 ) / ( srcNY + 2 ) );
+		int o = FLUID_IX( 0, j );
+		// the velocity sampler takes the planes in pairs
+		for( int p = 0; p < planes; p += 2 )
+		{
+			bool pair = p + 1 < planes;
+			kernels->sampleVelocity( src[p], src[ pair ? p + 1 : p ], &x[0], &y[0], dst[p] + o, pair ? dst[ p + 1 ] + o : &unused[0],
+									 n, srcNX, srcNY, srcStride );
+		}
+	}
+}
+
+void ciMsaFluidSolver::getVelocityAtPositions( const float *x, const float *y, float *vx, float *vy, int n ) const {
+	kernels->sampleVelocity( u, v, x, y, vx, vy, n, _NX, _NY, _rowStride );
+}
+
+size_t ciMsaFluidSolver::getMemoryUsage() const {
+	size_t bytes = arenaCapacity;
+	for( size_t k = 0; k < multigridLevels.size(); ++k )
+	{
+		const MultigridLevel &level = multigridLevels[k];
+		bytes += ( level.p.capacity() + level.rhs.capacity() + level.res.capacity() ) * sizeof(float);
 	}
+	bytes += activeTiles.capacity() * sizeof(unsigned char);
+	bytes += tileSpans.capacity() * sizeof(CellSpan);
+	bytes += tileSpanStart.capacity() * sizeof(int);
+	bytes += fadeSums.capacity() * sizeof(FadeSums);
+	return bytes;
+}
+
+size_t ciMsaFluidSolver::getArenaSize() const {
+	return arenaSize;
 }
 
 // return total number of cells (_NX+2) * (_NY+2)
@@ -212,6 +628,7 @@ float ciMsaFluidSolver::getVisc() const {
 ciMsaFluidSolver& ciMsaFluidSolver::setColorDiffusion( float diff )
 {
 	colorDiffusion = diff;
+	arrangeScratch();
 	return *this;
 }
 
@@ -243,165 +660,328 @@ template<class T> void SWAP( T& a, T& b)
 }
 #endif
 
-void ciMsaFluidSolver::swapR()		{	SWAP( r, rOld );	}
+void ciMsaFluidSolver::swapR()		{	SWAP( r, rOld );	SWAP( rFixed, rFixedOld );	}
 void ciMsaFluidSolver::swapRGB(){ 
 	SWAP( r, rOld );
 	SWAP( g, gOld );
 	SWAP( b, bOld );
+	SWAP( rFixed, rFixedOld );
+	SWAP( gFixed, gFixedOld );
+	SWAP( bFixed, bFixedOld );
+}
+void ciMsaFluidSolver::swapUV()	{
+	SWAP( u, uOld );
+	SWAP( v, vOld );
 }
-void ciMsaFluidSolver::swapUV()	{	SWAP( uv, uvOld ); }
 
 // Curl and vorticityConfinement based on code by Alexander McKenzie
-float ciMsaFluidSolver::calcCurl( int i, int j)
+// the first pass caches the signed curl of the cells, the second reads it back both for the gradient of its
+// magnitude and for the curl of the cell itself. the rows of a pass are independent of each other
+void ciMsaFluidSolver::vorticityConfinement(float* Fvc_x, float* Fvc_y) {
+	threadPool.parallelFor( 1, _NY + 1, [&]( int j0, int j1 ) {
+		for( int j = j0; j < j1; ++j )
+		{
+			for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+			{
+				int o = FLUID_IX( span->i0, j );
+				kernels->curlRow( curl + o, u + o, v + o, span->n, _rowStride );
+			}
+		}
+	} );
+	
+	// the force skips the outer ring of cells, their gradient would read the curl of the boundary
+	threadPool.parallelFor( 2, _NY, [&]( int j0, int j1 ) {
+		for( int j = j0; j < j1; ++j )
+		{
+			for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+			{
+				int i0 = ci::math<int>::max( span->i0, 2 );
+				int i1 = ci::math<int>::min( span->i0 + span->n, _NX );
+				if( i0 >= i1 )
+					continue;
+				int o = FLUID_IX( i0, j );
+				kernels->vorticityRow( Fvc_x + o, Fvc_y + o, curl + o, i1 - i0, _rowStride );
+			}
+		}
+	} );
+}
+
+// Active tiles
+// the grid is split into FLUID_TILE_SIZE square tiles. a step updates the tiles with fluid in them
+// and the tiles next to those, the rest is known to be zero in every plane and stays that way:
+// advection only moves values into cells that have velocity, the stencils of diffusion and the
+// projection reach one cell per sweep and fall off by at least 4 times with every cell, so a
+// tile of margin keeps what would cross it below the zero threshold
+
+// calls fn( offset, n ) for the runs of cells of the planes updated in this step, boundary cells included
+template< typename Fn > void ciMsaFluidSolver::forEachPlaneSpan( Fn fn ) const
 {
-	float du_dy = uv[FLUID_IX(i, j + 1)].x - uv[FLUID_IX(i, j - 1)].x;
-	float dv_dx = uv[FLUID_IX(i + 1, j)].y - uv[FLUID_IX(i - 1, j)].y;
-	return (du_dy - dv_dx) * 0.5f;	// for optimization should be moved to later and done with another operation
+	forEachPlaneSpan( 0, _NY + 2, fn );
 }
 
-void ciMsaFluidSolver::vorticityConfinement(ci::Vec2f* Fvc_xy) {
-	float dw_dx, dw_dy;
-	float length;
-	float v;
+// same for the rows [j0, j1) only
+template< typename Fn > void ciMsaFluidSolver::forEachPlaneSpan( int j0, int j1, Fn fn ) const
+{
+	if( !useActiveTiles() )
+	{
+		fn( FLUID_IX( 0, j0 ), ( j1 - j0 ) * _rowStride );
+		return;
+	}
 	
-	// Calculate magnitude of calcCurl(u,v) for each cell. (|w|)
-	for (int j = _NY; j > 0; --j )
+	for( int j = j0; j < j1; ++j )
 	{
-		for (int i = _NX; i > 0; --i )
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
 		{
-			curl[FLUID_IX(i, j)] = fabs(calcCurl(i, j));
+			int i0 = span->i0;
+			int i1 = span->i0 + span->n - 1;
+			if( i0 == 1 ) i0 = 0;
+			if( i1 == _NX ) i1 = _NX + 1;
+			fn( FLUID_IX( i0, j ), i1 - i0 + 1 );
 		}
 	}
+}
+
+// collects the runs of tiles in each tile row that are active or next to an active one
+void ciMsaFluidSolver::findActiveSpans()
+{
+	tileSpans.clear();
+	tileSpanStart.resize( tilesY + 1 );
+	numActiveTiles = 0;
 	
-	for (int j = _NY-1; j > 1; --j )	//for (int j = 2; j < _NY; j++)
+	for( int ty = 0; ty < tilesY; ++ty )
 	{
-		for (int i = _NX-1; i > 1; --i )		//for (int i = 2; i < _NX; i++)		
+		tileSpanStart[ ty ] = (int)tileSpans.size();
+		int runStart = -1;
+		for( int tx = 0; tx <= tilesX; ++tx )
 		{
-			// Find derivative of the magnitude (_N = del |w|)
-			dw_dx = (curl[FLUID_IX(i + 1, j)] - curl[FLUID_IX(i - 1, j)]);	// was * 0.5f; now done later with 2./lenght
-			dw_dy = (curl[FLUID_IX(i, j + 1)] - curl[FLUID_IX(i, j - 1)]);	// was * 0.5f;
-			
-			// Calculate vector length. (|_N|)
-			// Add small factor to prevent divide by zeros.
-			length = (float) sqrt(dw_dx * dw_dx + dw_dy * dw_dy) + 0.000001f;
-			
-			// N = ( _N/|_N| )
-			length = 2./length;	// the 2. come from the previous * 0.5
-			dw_dx *= length;
-			dw_dy *= length;
-			
-			v = calcCurl(i, j);
+			bool active = tx < tilesX && !useActiveTiles();
+			for( int dy = -1; dy <= 1 && tx < tilesX && !active; ++dy )
+			{
+				int y = ty + dy;
+				if( wrap_y )
+					y = ( y + tilesY ) % tilesY;
+				else if( y < 0 || y >= tilesY )
+					continue;
+				for( int dx = -1; dx <= 1 && !active; ++dx )
+				{
+					int x = tx + dx;
+					if( wrap_x )
+						x = ( x + tilesX ) % tilesX;
+					else if( x < 0 || x >= tilesX )
+						continue;
+					active = activeTiles[ x + tilesX * y ] != 0;
+				}
+			}
 			
-			// N x w
-			Fvc_xy[FLUID_IX(i, j)].x = dw_dy * -v;
-			Fvc_xy[FLUID_IX(i, j)].y = dw_dx *  v;
+			if( active )
+			{
+				++numActiveTiles;
+				if( runStart < 0 )
+					runStart = tx;
+			}
+			else if( runStart >= 0 )
+			{
+				CellSpan span;
+				span.i0 = 1 + runStart * FLUID_TILE_SIZE;
+				span.n = ci::math<int>::min( _NX, tx * FLUID_TILE_SIZE ) - span.i0 + 1;
+				tileSpans.push_back( span );
+				runStart = -1;
+			}
+		}
+	}
+	tileSpanStart[ tilesY ] = (int)tileSpans.size();
+}
+
+template< typename T >
+static bool isAboveThreshold( const T *x, int n, T threshold )
+{
+	for( int k = 0; k < n; ++k )
+		if( x[k] > threshold || x[k] < -threshold )
+			return true;
+	return false;
+}
+
+template< typename T >
+static void clearRows( T *x, int index, int n, int rows, int rowStride )
+{
+	for( int j = 0; j < rows; ++j )
+		memset( x + index + j * rowStride, 0, n * sizeof( T ) );
+}
+
+// keeps the updated tiles with values above the threshold active and clears the others
+void ciMsaFluidSolver::updateActiveTiles()
+{
+	float *planes[] = { u, v, r, g, b, curl };
+	int16_t *fixedPlanes[] = { rFixed, gFixed, bFixed };
+	int numPlanes = doRGB ? 5 : 3;
+	int16_t fixedThreshold = (int16_t)ci::math<float>::min( activeThreshold * FLUID_FIXED_ONE, 32767 );
+	
+	for( int ty = 0; ty < tilesY; ++ty )
+	{
+		int j0 = 1 + ty * FLUID_TILE_SIZE;
+		int j1 = ci::math<int>::min( _NY, j0 + FLUID_TILE_SIZE - 1 );
+		for( const CellSpan *span = spansBegin( j0 ); span != spansEnd( j0 ); ++span )
+		{
+			for( int i0 = span->i0; i0 < span->i0 + span->n; i0 += FLUID_TILE_SIZE )
+			{
+				int i1 = ci::math<int>::min( _NX, i0 + FLUID_TILE_SIZE - 1 );
+				bool active = false;
+				for( int j = j0; j <= j1 && !active; ++j )
+				{
+					for( int p = 0; p < numPlanes && !active; ++p )
+					{
+						if( doFixedColor && p >= 2 )
+							active = isAboveThreshold( fixedPlanes[p - 2] + FLUID_IX( i0, j ), i1 - i0 + 1, fixedThreshold );
+						else
+							active = isAboveThreshold( planes[p] + FLUID_IX( i0, j ), i1 - i0 + 1, activeThreshold );
+					}
+				}
+				
+				activeTiles[ ( i0 - 1 ) / FLUID_TILE_SIZE + tilesX * ty ] = active;
+				if( active )
+					continue;
+				
+				// at rest, clear it with the boundary cells next to it, the old planes were cleared by the fade
+				int ci0 = ( i0 == 1 ) ? 0 : i0;
+				int ci1 = ( i1 == _NX ) ? _NX + 1 : i1;
+				int cj0 = ( j0 == 1 ) ? 0 : j0;
+				int cj1 = ( j1 == _NY ) ? _NY + 1 : j1;
+				int index = FLUID_IX( ci0, cj0 );
+				for( int p = 0; p < 6; ++p )
+				{
+					if( doFixedColor && p >= 2 && p < 5 )
+						clearRows( fixedPlanes[p - 2], index, ci1 - ci0 + 1, cj1 - cj0 + 1, _rowStride );
+					else
+						clearRows( planes[p], index, ci1 - ci0 + 1, cj1 - cj0 + 1, _rowStride );
+				}
+			}
 		}
 	}
 }
 
 void ciMsaFluidSolver::update() {
+	// the workers pick the mode up from this thread for each job
+	ciMsaFluidDenormalGuard denormals( doFlushDenormals );
+	
+	solverIterationsUsed = 0;
+	solverChange = 0;
+	if( doStageTimes ) {
+		stageTimer.start();
+		stageStart = 0;
+	}
+	
+	applySplats();
+	endStage( STAGE_SPLAT );
+	
+	findActiveSpans();
+	
 	addSourceUV();
+	endStage( STAGE_ADD_SOURCE );
 	
 	if( doVorticityConfinement )
 	{
-		vorticityConfinement(uvOld);
+		vorticityConfinement(uOld, vOld);
 		addSourceUV();
+		endStage( STAGE_VORTICITY );
 	}
 	
 	swapUV();
 	
 	diffuseUV( viscocity );
+	endStage( STAGE_DIFFUSE );
 	
-	project(uv, uvOld);
+	project(u, v, uOld, vOld);
+	endStage( STAGE_PROJECT );
 	
 	swapUV();
 	
-	advect2d(uv, uvOld);
+	advect2d(u, v, uOld, vOld);
+	endStage( STAGE_ADVECT );
 	
-	project(uv, uvOld);
+	project(u, v, uOld, vOld, doStats);
+	endStage( STAGE_PROJECT );
 	
-	if(doRGB)
+	if(doFixedColor)
+	{
+		addSourceFixed();
+		swapRGB();
+		endStage( STAGE_ADD_SOURCE );
+		
+		if( colorDiffusion!=0. && _dt!=0. )
+		{
+			diffuseFixed( colorDiffusion );
+			swapRGB();
+			endStage( STAGE_DIFFUSE );
+		}
+		
+		advectFixed( u, v );
+		endStage( STAGE_ADVECT );
+		if(doRGB)
+			fadeRGB();
+		else
+			fadeR();
+	}
+	else if(doRGB)
 	{
 		addSourceRGB();
 		swapRGB();
+		endStage( STAGE_ADD_SOURCE );
 		
 		if( colorDiffusion!=0. && _dt!=0. )
 		{
 			diffuseRGB(0, colorDiffusion );
 			swapRGB();
+			endStage( STAGE_DIFFUSE );
 		}
 		
-		advectRGB(0, uv);
+		advectRGB(0, u, v);
+		endStage( STAGE_ADVECT );
 		fadeRGB();
 	} 
 	else
 	{
 		addSource(r, rOld);
 		swapR();
+		endStage( STAGE_ADD_SOURCE );
 		
 		if( colorDiffusion!=0. && _dt!=0. )
 		{
 			diffuse(0, r, rOld, colorDiffusion );
 			swapRGB();
+			endStage( STAGE_DIFFUSE );
 		}
 		
-		advect(0, r, rOld, uv);	
+		advect(0, r, rOld, u, v);	
+		endStage( STAGE_ADVECT );
 		fadeR();
 	}
+	
+	if( useActiveTiles() )
+		updateActiveTiles();
+	endStage( STAGE_FADE );
 }
 
-#define ZERO_THRESH		1e-9			// if value falls under this, set to zero (to avoid denormal slowdown)
-#define CHECK_ZERO(p)	if(fabsf(p)<ZERO_THRESH) p = 0
+#define ZERO_THRESH		1e-9f			// values under this are set to zero, so faded cells end up empty and stay out of the denormal range with the flush off
+#define FADE_BLOCK_ROWS	16				// rows summed together by fade, fixed so the sums don't depend on the threads
+#define FADE_DITHER_ADVANCE	0.754878f	// change of the fixed point dither from frame to frame
 
 void ciMsaFluidSolver::fadeR() {
 	// I want the fluid to gradually fade out so the screen doesn't fill. the amount it fades out depends on how full it is, and how uniform (i.e. boring) the fluid is...
 	//		float holdAmount = 1 - _avgDensity * _avgDensity * fadeSpeed;	// this is how fast the density will decay depending on how full the screen currently is
 	float holdAmount = 1 - fadeSpeed;
 	
-	_avgDensity = 0;
-	_avgSpeed = 0;
+	FadeSums sums = fadePlanes( holdAmount );
+	if( !doStats )
+		return;
 	
-	float totalDeviations = 0;
-	float currentDeviation;
-	float tmp_r;
-	//	float uniformityMult = uniformity * 0.05f;
+	_avgSpeed = sums.speed;
 	
-	_avgSpeed = 0;
-	for (int i = _numCells-1; i >=0; --i) {
-		// clear old values
-		uvOld[i] = ci::Vec2f::zero(); 
-		rOld[i] = 0;
-		//		gOld[i] = bOld[i] = 0;
-		
-		// calc avg speed
-		_avgSpeed += uv[i].x * uv[i].x + uv[i].y * uv[i].y;
-		
-		// calc avg density
-		tmp_r = ci::math<float>::min( 1.0f, r[i] );
-		
-		//		g[i] = MIN(1.0f, g[i]);
-		//		b[i] = MIN(1.0f, b[i]);
-		//		float density = MAX(r[i], MAX(g[i], b[i]));
-		_avgDensity += tmp_r;	// add it up
-		
-		// calc deviation (for uniformity)
-		currentDeviation = tmp_r - _avgDensity;
-		totalDeviations += currentDeviation * currentDeviation;
-		
-		// fade out old
-		r[i] = tmp_r * holdAmount;
-		
-		CHECK_ZERO(r[i]);
-		CHECK_ZERO(uv[i].x);
-		CHECK_ZERO(uv[i].y);
-		if(doVorticityConfinement) CHECK_ZERO(curl[i]);
-		
-	}
-	_avgDensity *= _invNumCells;
+	_avgDensity = sums.density * _invNumCells;
 	//	_avgSpeed *= _invNumCells;
 	
-	//	println("%.3f\n", _avgSpeed);
-	_uniformity = 1.0f / (1 + totalDeviations * _invNumCells);		// 0: very wide distribution, 1: very uniform
+	// variance of the density (for uniformity)
+	float variance = ci::math<float>::max( 0.0f, sums.densitySq * _invNumCells - _avgDensity * _avgDensity );
+	_uniformity = 1.0f / (1 + variance);		// 0: very wide distribution, 1: very uniform
 }
 
 
@@ -410,209 +990,455 @@ void ciMsaFluidSolver::fadeRGB() {
 	//		float holdAmount = 1 - _avgDensity * _avgDensity * fadeSpeed;	// this is how fast the density will decay depending on how full the screen currently is
 	float holdAmount = 1 - fadeSpeed;
 	
-	_avgDensity = 0;
-	_avgSpeed = 0;
+	FadeSums sums = fadePlanes( holdAmount );
+	if( !doStats )
+		return;
 	
-	float totalDeviations = 0;
-	float currentDeviation;
-	//	float uniformityMult = _uniformity * 0.05f;
-	float tmp_r, tmp_g, tmp_b;
-	_avgSpeed = 0;
-	for (int i = _numCells-1; i >=0; --i)
-	{
-		// clear old values
-		uvOld[i] = ci::Vec2f::zero();
-		rOld[i] = 0;
-		gOld[i] = bOld[i] = 0;
-		
-		// calc avg speed
-		_avgSpeed += uv[i].x * uv[i].x + uv[i].y * uv[i].y;
-		
-		// calc avg density
-		tmp_r = ci::math<float>::min( 1.0f, r[i] );
-		tmp_g = ci::math<float>::min( 1.0f, g[i] );
-		tmp_b = ci::math<float>::min( 1.0f, b[i] );
+	_avgDensity = sums.density * _invNumCells;
+	_avgSpeed = sums.speed * _invNumCells;
+	
+	// variance of the density (for _uniformity)
+	float variance = ci::math<float>::max( 0.0f, sums.densitySq * _invNumCells - _avgDensity * _avgDensity );
+	_uniformity = 1.0f / (1 + variance);		// 0: very wide distribution, 1: very uniform
+}
 
-		float density = ci::math<float>::max( tmp_r, ci::math<float>::max( tmp_g, tmp_b ) );
-		_avgDensity += density;	// add it up
-		
-		// calc deviation (for _uniformity)
-		currentDeviation = density - _avgDensity;
-		totalDeviations += currentDeviation * currentDeviation;
-		
-		// fade out old
-		r[i] = tmp_r * holdAmount;
-		g[i] = tmp_g * holdAmount;
-		b[i] = tmp_b * holdAmount;
-		
-		CHECK_ZERO(r[i]);
-		CHECK_ZERO(g[i]);
-		CHECK_ZERO(b[i]);
-		CHECK_ZERO(uv[i].x);
-		CHECK_ZERO(uv[i].y);
-		if(doVorticityConfinement) CHECK_ZERO(curl[i]);
-	}
-	_avgDensity *= _invNumCells;
-	_avgSpeed *= _invNumCells;
+// clears the old planes, flushes the velocity and fades the color in blocks of FADE_BLOCK_ROWS rows.
+// each block sums its own speed and density and the blocks are added up in order, so the sums
+// are the same for any number of threads. without stats the sums are skipped and left at zero
+ciMsaFluidSolver::FadeSums ciMsaFluidSolver::fadePlanes( float holdAmount )
+{
+	int numBlocks = ( _NY + 2 + FADE_BLOCK_ROWS - 1 ) / FADE_BLOCK_ROWS;
+	fadeSums.resize( numBlocks );
 	
-	//println("%.3f\n", _avgDensity);
-	_uniformity = 1.0f / (1 + totalDeviations * _invNumCells);		// 0: very wide distribution, 1: very uniform
+	std::function< void ( int, int ) > fadeBlocks = [&]( int k0, int k1 )
+	{
+		for( int k = k0; k < k1; ++k )
+		{
+			FadeSums &block = fadeSums[k];
+			block.speed = block.density = block.densitySq = 0;
+			float *speed = doStats ? &block.speed : NULL;
+			float *density = doStats ? &block.density : NULL;
+			
+			int j0 = k * FADE_BLOCK_ROWS;
+			int j1 = ci::math<int>::min( j0 + FADE_BLOCK_ROWS, _NY + 2 );
+			forEachPlaneSpan( j0, j1, [&]( int o, int n ) {
+				// clear old values
+				memset( uOld + o, 0, n * sizeof( float ) );
+				memset( vOld + o, 0, n * sizeof( float ) );
+				if( doFixedColor )
+				{
+					memset( rFixedOld + o, 0, n * sizeof( int16_t ) );
+					if( doRGB )
+					{
+						memset( gFixedOld + o, 0, n * sizeof( int16_t ) );
+						memset( bFixedOld + o, 0, n * sizeof( int16_t ) );
+					}
+				}
+				else
+				{
+					memset( rOld + o, 0, n * sizeof( float ) );
+					if( doRGB )
+					{
+						memset( gOld + o, 0, n * sizeof( float ) );
+						memset( bOld + o, 0, n * sizeof( float ) );
+					}
+				}
+				
+				// calc avg speed
+				kernels->flushZero( u + o, ZERO_THRESH, n, speed );
+				kernels->flushZero( v + o, ZERO_THRESH, n, speed );
+				if( doVorticityConfinement )
+					kernels->flushZero( curl + o, ZERO_THRESH, n, NULL );
+				
+				// calc avg density (of the brightest component) and fade out old
+				// the dither of a fixed point cell only depends on its index and the frame
+				double phase = ditherPhase + o * (double)FLUID_DITHER_STEP;
+				phase -= floor( phase );
+				if( doFixedColor && doRGB )
+					kernels->fadeRGBFixed( rFixed + o, gFixed + o, bFixed + o, holdAmount, (float)phase, n, density, &block.densitySq );
+				else if( doFixedColor )
+					kernels->fadeFixed( rFixed + o, holdAmount, (float)phase, n, density, &block.densitySq );
+				else if( doRGB )
+					kernels->fadeRGB( r + o, g + o, b + o, holdAmount, ZERO_THRESH, n, density, &block.densitySq );
+				else
+					kernels->fade( r + o, holdAmount, ZERO_THRESH, n, density, &block.densitySq );
+			} );
+		}
+	};
+	threadPool.parallelFor( 0, numBlocks, fadeBlocks );
+	ditherPhase += FADE_DITHER_ADVANCE;
+	ditherPhase -= floorf( ditherPhase );
+	
+	FadeSums sums = { 0, 0, 0 };
+	if( !doStats )
+		return sums;
+	
+	double speed = 0;
+	double density = 0;
+	double densitySq = 0;
+	for( int k = 0; k < numBlocks; ++k )
+	{
+		speed += fadeSums[k].speed;
+		density += fadeSums[k].density;
+		densitySq += fadeSums[k].densitySq;
+	}
+	sums.speed = (float)speed;
+	sums.density = (float)density;
+	sums.densitySq = (float)densitySq;
+	return sums;
 }
 
 
 void ciMsaFluidSolver::addSourceUV()
 {
-	for (int i = _numCells-1; i >=0; --i)
-	{
-		uv[i].x += _dt * uvOld[i].x;
-		uv[i].y += _dt * uvOld[i].y;
-	}
+	forEachPlaneSpan( [&]( int o, int n ) {
+		kernels->addSource( u + o, uOld + o, _dt, n );
+		kernels->addSource( v + o, vOld + o, _dt, n );
+	} );
 }
 
 void ciMsaFluidSolver::addSourceRGB()
 {
-	for (int i = _numCells-1; i >=0; --i)
-	{
-		r[i] += _dt * rOld[i];
-		g[i] += _dt * gOld[i];
-		b[i] += _dt * bOld[i];		
-	}
+	forEachPlaneSpan( [&]( int o, int n ) {
+		kernels->addSource( r + o, rOld + o, _dt, n );
+		kernels->addSource( g + o, gOld + o, _dt, n );
+		kernels->addSource( b + o, bOld + o, _dt, n );
+	} );
 }
 
 void ciMsaFluidSolver::addSource(float* x, float* x0) {
-	for (int i = _numCells-1; i >=0; --i)
+	forEachPlaneSpan( [&]( int o, int n ) {
+		kernels->addSource( x + o, x0 + o, _dt, n );
+	} );
+}
+
+void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const float* du, const float* dv) {
+	advectPlanes( &d, &d0, 1, du, dv );
+	setBoundary(bound, d);
+	
+	if( advectionMethod == ADVECTION_MACCORMACK )
 	{
-		x[i] += _dt * x0[i];
+		correctAdvection( &d, &d0, 1, du, dv );
+		setBoundary(bound, d);
 	}
 }
 
-void ciMsaFluidSolver::advect( int bound, float* d, const float* d0, const ci::Vec2f* duv) {
-	int i0, j0, i1, j1;
-	float x, y, s0, t0, s1, t1;
-	int	index;
+//          d    d0    du    dv
+// advect(1, u, uOld, uOld, vOld);
+// advect(2, v, vOld, uOld, vOld);
+void ciMsaFluidSolver::advect2d( float *u, float *v, const float *du, const float *dv ) {
+	float *dst[2] = { u, v };
+	const float *src[2] = { du, dv };
 	
-	const float dt0x = _dt * _NX;
-	const float dt0y = _dt * _NY;
+	advectPlanes( dst, src, 2, du, dv );
+	setBoundary2d(1, u, v);
+	setBoundary2d(2, u, v);
 	
-	for (int j = _NY; j > 0; --j)
+	if( advectionMethod == ADVECTION_MACCORMACK )
 	{
-		for (int i = _NX; i > 0; --i)
-		{
-			index = FLUID_IX(i, j);
-			x = i - dt0x * duv[index].x;
-			y = j - dt0y * duv[index].y;
-			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
-			
-			i0 = (int) x;
-			i1 = i0 + 1;
-			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
-			
-			j0 = (int) y;
-			j1 = j0 + 1;
-			
-			s1 = x - i0;
-			s0 = 1 - s1;
-			t1 = y - j0;
-			t0 = 1 - t1;
-			
-			d[index] = s0 * (t0 * d0[FLUID_IX(i0, j0)] + t1 * d0[FLUID_IX(i0, j1)])
-						+ s1 * (t0 * d0[FLUID_IX(i1, j0)] + t1 * d0[FLUID_IX(i1, j1)]);
-			
+		correctAdvection( dst, src, 2, du, dv );
+		setBoundary2d(1, u, v);
+		setBoundary2d(2, u, v);
+	}
+}
+
+void ciMsaFluidSolver::advectRGB(int bound, const float* du, const float* dv) {
+	float *dst[3] = { r, g, b };
+	const float *src[3] = { rOld, gOld, bOld };
+	
+	advectPlanes( dst, src, 3, du, dv );
+	setBoundaryRGB();
+	
+	if( advectionMethod == ADVECTION_MACCORMACK )
+	{
+		correctAdvection( dst, src, 3, du, dv );
+		setBoundaryRGB();
+	}
+}
+
+// semi-lagrangian step of the interior cells of up to three planes, traced back along ( du, dv ) times dtScale
+void ciMsaFluidSolver::advectPlanes( float *const *d, const float *const *d0, int planes, const float *du, const float *dv, float dtScale ) {
+	const float dt0x = _dt * _NX * dtScale;
+	const float dt0y = _dt * _NY * dtScale;
+	
+	for (int j = _NY; j > 0; --j)
+	{
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+		{
+			int index = FLUID_IX(span->i0, j);
+			float *dst[3];
+			for( int p = 0; p < planes; ++p )
+				dst[p] = d[p] + index;
+			kernels->advectRow( dst, d0, planes, du + index, dv + index, span->i0, j, span->n, _NX, _NY, _rowStride, dt0x, dt0y );
 		}
 	}
-	setBoundary(bound, d);
 }
 
-//          d    d0    du    dv
-// advect(1, u, uOld, uOld, vOld);
-// advect(2, v, vOld, uOld, vOld);
-void ciMsaFluidSolver::advect2d( ci::Vec2f *uv, const ci::Vec2f *duv ) {
-	int i0, j0, i1, j1;
-	float s0, t0, s1, t1;
-	int	index;
+// MacCormack: d holds d0 advected forward with its boundary set. advecting it back to the start of
+// the step and comparing with d0 gives the error of the round trip, half of which is the error of the
+// forward step and is taken off d. the correction is clamped to the cells the forward step
+// interpolated from, so it stays as stable as the plain semi-lagrangian step
+void ciMsaFluidSolver::correctAdvection( float *const *d, const float *const *d0, int planes, const float *du, const float *dv ) {
+	advectPlanes( scratch, d, planes, du, dv, -1 );
 	
 	const float dt0x = _dt * _NX;
 	const float dt0y = _dt * _NY;
-	
 	for (int j = _NY; j > 0; --j)
 	{
-		for (int i = _NX; i > 0; --i)
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
 		{
-			index = FLUID_IX(i, j);
-			float x = i - dt0x * duv[index].x;
-			float y = j - dt0y * duv[index].y;
-			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
-			
-			i0 = (int) x;
-			i1 = i0 + 1;
-			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
-			
-			j0 = (int) y;
-			j1 = j0 + 1;
-			
-			s1 = x - i0;
-			s0 = 1 - s1;
-			t1 = y - j0;
-			t0 = 1 - t1;
-			
-			uv[index].x = s0 * (t0 * duv[FLUID_IX(i0, j0)].x + t1 * duv[FLUID_IX(i0, j1)].x)
-						+ s1 * (t0 * duv[FLUID_IX(i1, j0)].x + t1 * duv[FLUID_IX(i1, j1)].x);
-			uv[index].y = s0 * (t0 * duv[FLUID_IX(i0, j0)].y + t1 * duv[FLUID_IX(i0, j1)].y)
-						+ s1 * (t0 * duv[FLUID_IX(i1, j0)].y + t1 * duv[FLUID_IX(i1, j1)].y);
-			
+			int index = FLUID_IX(span->i0, j);
+			float *dst[3];
+			const float *back[3];
+			for( int p = 0; p < planes; ++p )
+			{
+				dst[p] = d[p] + index;
+				back[p] = scratch[p] + index;
+			}
+			kernels->maccormackRow( dst, d0, back, planes, du + index, dv + index, span->i0, j, span->n, _NX, _NY, _rowStride, dt0x, dt0y );
+		}
+	}
+}
+
+// Splats
+
+#define SPLAT_BAND_ROWS		8			// rows of the grid a thread adds the splats to at a time
+
+void ciMsaFluidSolver::addSplats( const Splat *splats, int count ) {
+	std::lock_guard< std::mutex > lock( splatMutex );
+	splatQueue.insert( splatQueue.end(), splats, splats + count );
+}
+
+// adds the splats queued since the last update. the footprints and their weights are found first, then
+// bands of rows add the splats over them in queue order, so the result is the same for any number of threads
+void ciMsaFluidSolver::applySplats() {
+	splatBatch.clear();
+	{
+		std::lock_guard< std::mutex > lock( splatMutex );
+		splatBatch.swap( splatQueue );
+	}
+	int count = (int)splatBatch.size();
+	if( !count )
+		return;
+	splatFootprints.resize( count );
+	
+	threadPool.parallelFor( 0, count, [&]( int k0, int k1 ) {
+		for( int k = k0; k < k1; ++k )
+		{
+			const Splat &splat = splatBatch[k];
+			SplatFootprint &f = splatFootprints[k];
+			f.x = splat.pos.x * _NX + 1;
+			f.y = splat.pos.y * _NY + 1;
+			f.norm = 0;
+			float radius = ci::math<float>::min( splat.radius * _NX, (float)( _NX + _NY ) );
+			if( radius >= 0.5f )
+			{
+				// the weights are summed over the whole footprint, the part off the grid is lost
+				f.invRadiusSq = 1.0f / ( radius * radius );
+				f.i0 = (int)floorf( f.x - radius );
+				f.i1 = (int)floorf( f.x + radius );
+				f.j0 = (int)floorf( f.y - radius );
+				f.j1 = (int)floorf( f.y + radius );
+				float sum = 0;
+				for( int j = f.j0; j <= f.j1; ++j )
+					for( int i = f.i0; i <= f.i1; ++i )
+						sum += splatWeight( f, i, j );
+				if( sum > 0 )
+					f.norm = 1.0f / sum;
+				f.i0 = ci::math<int>::max( f.i0, 1 );
+				f.i1 = ci::math<int>::min( f.i1, _NX );
+				f.j0 = ci::math<int>::max( f.j0, 1 );
+				f.j1 = ci::math<int>::min( f.j1, _NY );
+			}
+			if( f.norm == 0 )
+			{
+				// the cell addForceAtPos would add to, or none off the grid
+				int i = (int)f.x;
+				int j = (int)f.y;
+				bool inside = 0 <= i && i <= _NX + 1 && 0 <= j && j <= _NY + 1;
+				f.invRadiusSq = 0;
+				f.norm = 1;
+				f.i0 = f.i1 = i;
+				f.j0 = f.j1 = j;
+				if( !inside )
+					f.i1 = i - 1;
+			}
+		}
+	} );
+	
+	int numBands = ( _NY + 2 + SPLAT_BAND_ROWS - 1 ) / SPLAT_BAND_ROWS;
+	threadPool.parallelFor( 0, numBands, [&]( int b0, int b1 ) {
+		int j0 = b0 * SPLAT_BAND_ROWS;
+		int j1 = ci::math<int>::min( b1 * SPLAT_BAND_ROWS, _NY + 2 ) - 1;
+		for( int k = 0; k < count; ++k )
+		{
+			const Splat &splat = splatBatch[k];
+			const SplatFootprint &f = splatFootprints[k];
+			bool addColor = splat.color.r != 0 || ( doRGB && ( splat.color.g != 0 || splat.color.b != 0 ) );
+			int fj0 = ci::math<int>::max( f.j0, j0 );
+			int fj1 = ci::math<int>::min( f.j1, j1 );
+			for( int j = fj0; j <= fj1; ++j )
+			{
+				for( int i = f.i0; i <= f.i1; ++i )
+				{
+					float w = splatWeight( f, i, j ) * f.norm;
+					if( w == 0 )
+						continue;
+					int index = FLUID_IX( i, j );
+					u[index] += splat.force.x * w;
+					v[index] += splat.force.y * w;
+					if( !addColor )
+						continue;
+					if( doFixedColor )
+					{
+						rFixedOld[index] = toFixedColor( fromFixedColor( rFixedOld[index] ) + splat.color.r * w );
+						if( doRGB )
+						{
+							gFixedOld[index] = toFixedColor( fromFixedColor( gFixedOld[index] ) + splat.color.g * w );
+							bFixedOld[index] = toFixedColor( fromFixedColor( bFixedOld[index] ) + splat.color.b * w );
+						}
+					}
+					else
+					{
+						rOld[index] += splat.color.r * w;
+						if( doRGB )
+						{
+							gOld[index] += splat.color.g * w;
+							bOld[index] += splat.color.b * w;
+						}
+					}
+				}
+			}
 		}
+	} );
+	
+	if( !useActiveTiles() )
+		return;
+	for( int k = 0; k < count; ++k )
+	{
+		const SplatFootprint &f = splatFootprints[k];
+		if( f.i0 > f.i1 || f.j0 > f.j1 )
+			continue;
+		for( int j = f.j0; j < f.j1 + FLUID_TILE_SIZE; j += FLUID_TILE_SIZE )
+			for( int i = f.i0; i < f.i1 + FLUID_TILE_SIZE; i += FLUID_TILE_SIZE )
+				touchCell( ci::math<int>::min( i, f.i1 ), ci::math<int>::min( j, f.j1 ) );
 	}
-	setBoundary2d(1, uv);
-	setBoundary2d(2, uv);	
 }
 
-void ciMsaFluidSolver::advectRGB(int bound, const ci::Vec2f* duv) {
-	int i0, j0;
-	float x, y, s0, t0, s1, t1, dt0x, dt0y;
-	int	index;
+// Fixed point color
+// the color planes are kept in 16 bit fixed point and each pass converts them to float as it goes,
+// except for the diffusion which goes through the float scratch planes one color at a time
+
+void ciMsaFluidSolver::addSourceFixed() {
+	forEachPlaneSpan( [&]( int o, int n ) {
+		kernels->addSourceFixed( rFixed + o, rFixedOld + o, _dt, n );
+		if( doRGB )
+		{
+			kernels->addSourceFixed( gFixed + o, gFixedOld + o, _dt, n );
+			kernels->addSourceFixed( bFixed + o, bFixedOld + o, _dt, n );
+		}
+	} );
+}
+
+void ciMsaFluidSolver::diffuseFixed( float diff ) {
+	float a = _dt * diff * _NX * _NY;
+	int16_t *x[3] = { rFixed, gFixed, bFixed };
+	const int16_t *x0[3] = { rFixedOld, gFixedOld, bFixedOld };
 	
-	dt0x = _dt * _NX;
-	dt0y = _dt * _NY;
+	for( int p = 0; p < ( doRGB ? 3 : 1 ); ++p )
+	{
+		kernels->fromFixed( scratch[0], x0[p], _planeSize );
+		kernels->fromFixed( scratch[1], x[p], _planeSize );
+		linearSolver( 0, scratch[1], scratch[0], a, 1.0 + 4 * a );
+		kernels->toFixed( x[p], scratch[1], _planeSize );
+	}
+}
+
+void ciMsaFluidSolver::advectFixed( const float *du, const float *dv ) {
+	const float dt0x = _dt * _NX;
+	const float dt0y = _dt * _NY;
+	int16_t *dst[3] = { rFixed, gFixed, bFixed };
+	const int16_t *src[3] = { rFixedOld, gFixedOld, bFixedOld };
+	int planes = doRGB ? 3 : 1;
 	
 	for (int j = _NY; j > 0; --j)
 	{
-		for (int i = _NX; i > 0; --i)
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
 		{
-			index = FLUID_IX(i, j);
-			x = i - dt0x * duv[index].x;
-			y = j - dt0y * duv[index].y;
-			
-			if (x > _NX + 0.5) x = _NX + 0.5f;
-			if (x < 0.5)     x = 0.5f;
-			
-			i0 = (int) x;
-			
-			if (y > _NY + 0.5) y = _NY + 0.5f;
-			if (y < 0.5)     y = 0.5f;
-			
-			j0 = (int) y;
-			
-			s1 = x - i0;
-			s0 = 1 - s1;
-			t1 = y - j0;
-			t0 = 1 - t1;
-			
-			i0 = FLUID_IX(i0, j0);	//we don't need col/row index any more but index in 1 dimension
-			j0 = i0 + (_NX + 2);
-			r[index] = s0 * ( t0 * rOld[i0] + t1 * rOld[j0] ) + s1 * ( t0 * rOld[i0+1] + t1 * rOld[j0+1] );
-			g[index] = s0 * ( t0 * gOld[i0] + t1 * gOld[j0] ) + s1 * ( t0 * gOld[i0+1] + t1 * gOld[j0+1] );                  
-			b[index] = s0 * ( t0 * bOld[i0] + t1 * bOld[j0] ) + s1 * ( t0 * bOld[i0+1] + t1 * bOld[j0+1] );                          
+			int index = FLUID_IX(span->i0, j);
+			int16_t *d[3];
+			for( int p = 0; p < planes; ++p )
+				d[p] = dst[p] + index;
+			kernels->advectRowFixed( d, src, planes, du + index, dv + index, span->i0, j, span->n, _NX, _NY, _rowStride, dt0x, dt0y );
 		}
 	}
-	setBoundaryRGB();
+	for( int p = 0; p < planes; ++p )
+		setBoundaryFixed( dst[p], !doRGB );
+	
+	if( advectionMethod != ADVECTION_MACCORMACK )
+		return;
+	
+	// as in correctAdvection
+	for (int j = _NY; j > 0; --j)
+	{
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+		{
+			int index = FLUID_IX(span->i0, j);
+			float *back[3];
+			for( int p = 0; p < planes; ++p )
+				back[p] = scratch[p] + index;
+			kernels->advectRowFromFixed( back, dst, planes, du + index, dv + index, span->i0, j, span->n, _NX, _NY, _rowStride, -dt0x, -dt0y );
+		}
+	}
+	for (int j = _NY; j > 0; --j)
+	{
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+		{
+			int index = FLUID_IX(span->i0, j);
+			int16_t *d[3];
+			const float *back[3];
+			for( int p = 0; p < planes; ++p )
+			{
+				d[p] = dst[p] + index;
+				back[p] = scratch[p] + index;
+			}
+			kernels->maccormackRowFixed( d, src, back, planes, du + index, dv + index, span->i0, j, span->n, _NX, _NY, _rowStride, dt0x, dt0y );
+		}
+	}
+	for( int p = 0; p < planes; ++p )
+		setBoundaryFixed( dst[p], !doRGB );
+}
+
+// setBoundary( 0, x ) of a fixed point plane, the corners are only set for the monochrome color like setBoundaryRGB does
+void ciMsaFluidSolver::setBoundaryFixed( int16_t *x, bool corners ) {
+	int dst1, dst2, src1, src2;
+	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
+	
+	dst1 = FLUID_IX(0, 1);
+	src1 = FLUID_IX(1, 1);
+	dst2 = FLUID_IX(_NX+1, 1 );
+	src2 = FLUID_IX(_NX, 1);
+	if( wrap_x )
+		SWAP( src1, src2 );
+	for (int i = _NY; i > 0; --i )
+	{
+		x[dst1] = x[src1];	dst1 += step;	src1 += step;
+		x[dst2] = x[src2];	dst2 += step;	src2 += step;
+	}
+	
+	src1 = FLUID_IX(1, 1);
+	src2 = FLUID_IX(1, _NY);
+	if( wrap_y )
+		SWAP( src1, src2 );
+	memcpy( x + FLUID_IX(1, 0), x + src1, _NX * sizeof( int16_t ) );
+	memcpy( x + FLUID_IX(1, _NY+1), x + src2, _NX * sizeof( int16_t ) );
+	
+	if( !corners )
+		return;
+	x[FLUID_IX(  0,   0)] = toFixedColor( 0.5f * ( fromFixedColor( x[FLUID_IX(1, 0  )] ) + fromFixedColor( x[FLUID_IX(  0, 1)] ) ) );
+	x[FLUID_IX(  0, _NY+1)] = toFixedColor( 0.5f * ( fromFixedColor( x[FLUID_IX(1, _NY+1)] ) + fromFixedColor( x[FLUID_IX(  0, _NY)] ) ) );
+	x[FLUID_IX(_NX+1,   0)] = toFixedColor( 0.5f * ( fromFixedColor( x[FLUID_IX(_NX, 0  )] ) + fromFixedColor( x[FLUID_IX(_NX+1, 1)] ) ) );
+	x[FLUID_IX(_NX+1, _NY+1)] = toFixedColor( 0.5f * ( fromFixedColor( x[FLUID_IX(_NX, _NY+1)] ) + fromFixedColor( x[FLUID_IX(_NX+1, _NY)] ) ) );
 }
 
 void ciMsaFluidSolver::diffuse( int bound, float* c, float* c0, float diff )
@@ -633,142 +1459,872 @@ void ciMsaFluidSolver::diffuseUV( float diff )
 	linearSolverUV( a, 1.0 + 4 * a );
 }
 
-void ciMsaFluidSolver::project(ci::Vec2f* xy, ci::Vec2f* pDiv) 
+void ciMsaFluidSolver::project(float* x, float* y, float* p, float* div, bool residual)
 {
 	float	h;
 	int		index;
-	int		step_x = _NX + 2;
+	int		step_x = _rowStride;
 	
+	// the relaxation keeps the original scheme the look is tuned to, it starts from the scaled divergence
+	// and relaxes it with a zero right-hand side. multigrid solves for the divergence from zero
+	bool multigrid = projectionMethod == PROJECTION_MULTIGRID;
 	h = - 0.5f / _NX;
 	for (int j = _NY; j > 0; --j)
 	{
-		index = FLUID_IX(_NX, j);
-		for (int i = _NX; i > 0; --i)
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
 		{
-			pDiv[index].x = h * ( xy[index+1].x - xy[index-1].x + xy[index+step_x].y - xy[index-step_x].y );
-			pDiv[index].y = 0;
-			--index;
+			index = FLUID_IX(span->i0 + span->n - 1, j);
+			for (int i = span->n; i > 0; --i)
+			{
+				float d = h * ( x[index+1] - x[index-1] + y[index+step_x] - y[index-step_x] );
+				p[index] = multigrid ? 0 : d;
+				div[index] = multigrid ? d : 0;
+				--index;
+			}
 		}
 	}
 	
-	setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pDiv[0].x ));
-	setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pDiv[0].y ));
+	setBoundary(0, p);
+	setBoundary(0, div);
 	
-	linearSolverProject( pDiv );
+	if( projectionMethod == PROJECTION_MULTIGRID )
+		linearSolverProjectMultigrid( p, div );
+	else
+		linearSolverProject( p, div );
+	if( residual )
+		projectionResidual = calcProjectionResidual( p, x, y );
 	
 	float fx = 0.5f * _NX;
 	float fy = 0.5f * _NY;	//maa	change it from _NX to _NY
 	for (int j = _NY; j > 0; --j)
 	{
-		index = FLUID_IX(_NX, j);
-		for (int i = _NX; i > 0; --i)
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
 		{
-			xy[index].x -= fx * (pDiv[index+1].x - pDiv[index-1].x);
-			xy[index].y -= fy * (pDiv[index+step_x].x - pDiv[index-step_x].x);
-			--index;
+			index = FLUID_IX(span->i0 + span->n - 1, j);
+			for (int i = span->n; i > 0; --i)
+			{
+				x[index] -= fx * (p[index+1] - p[index-1]);
+				y[index] -= fy * (p[index+step_x] - p[index-step_x]);
+				--index;
+			}
 		}
 	}
 	
-	setBoundary2d(1, xy);
-	setBoundary2d(2, xy);
+	setBoundary2d(1, x, y);
+	setBoundary2d(2, x, y);
 }
 
 
 //	Gauss-Seidel relaxation
+//	every sweep also tracks the largest change of a cell (in velocity or color units), solverTolerance
+//	stops the iterations once it gets small enough, solverIterations is the maximum number of sweeps then
 void ciMsaFluidSolver::linearSolver( int bound, float* __restrict x, const float* __restrict x0, float a, float c )
 {
-	int	step_x = _NX + 2;
+	if( solverMethod == SOLVER_RED_BLACK )
+	{
+		linearSolverRedBlack( bound, x, x0, a, c );
+		return;
+	}
+	
+	int	step_x = _rowStride;
 	int index;
 	c = 1. / c;
+	float delta = 0;
 	for (int k = solverIterations; k > 0; --k)	// MEMO 
 	{
+		delta = 0;
 		for (int j = _NY; j > 0 ; --j)
 		{
-			index = FLUID_IX(_NX, j );
-			for (int i = _NX; i > 0 ; --i)
+			// the spans from right to left keep the order of the sweep
+			for( const CellSpan *span = spansEnd( j ); span-- != spansBegin( j ); )
 			{
-				x[index] = ( ( x[index-1] + x[index+1] + x[index - step_x] + x[index + step_x] ) * a + x0[index] ) * c;
-				--index;
+				index = FLUID_IX(span->i0 + span->n - 1, j );
+				for (int i = span->n; i > 0 ; --i)
+				{
+					float old = x[index];
+					x[index] = ( ( x[index-1] + x[index+1] + x[index - step_x] + x[index + step_x] ) * a + x0[index] ) * c;
+					delta = ci::math<float>::max( delta, fabsf( x[index] - old ) );
+					--index;
+				}
 			}
 		}
 		setBoundary( bound, x );
+		if( isSolverConverged( delta ) )
+			break;
 	}
+	endSolve( delta );
 }
 
-void ciMsaFluidSolver::linearSolverProject( ci::Vec2f* __restrict pdiv )
+void ciMsaFluidSolver::linearSolverProject( float* __restrict p, const float* __restrict div )
 {
-	int	step_x = _NX + 2;
+	if( solverMethod == SOLVER_RED_BLACK )
+	{
+		linearSolverProjectRedBlack( p, div );
+		return;
+	}
+	
+	int	step_x = _rowStride;
 	int index;
+	float delta = 0;
 	for (int k = solverIterations; k > 0; --k) {
+		delta = 0;
 		for (int j = _NY; j > 0 ; --j) {
-			index = FLUID_IX(_NX, j );
-			float prev = pdiv[index+1].x;
-			for (int i = _NX; i > 0 ; --i)
+			for( const CellSpan *span = spansEnd( j ); span-- != spansBegin( j ); )
 			{
-				prev = ( pdiv[index-1].x + prev + pdiv[index - step_x].x + pdiv[index + step_x].x + pdiv[index].y ) * .25;
-				pdiv[index].x = prev;
-				--index;				
+				index = FLUID_IX(span->i0 + span->n - 1, j );
+				float prev = p[index+1];
+				for (int i = span->n; i > 0 ; --i)
+				{
+					prev = ( p[index-1] + prev + p[index - step_x] + p[index + step_x] + div[index] ) * .25;
+					delta = ci::math<float>::max( delta, fabsf( prev - p[index] ) );
+					p[index] = prev;
+					--index;				
+				}
 			}
 		}
-		setBoundary02d( reinterpret_cast<ci::Vec2f*>( &pdiv[0].x ) );
+		setBoundary( 0, p );
+		delta *= getPressureScale();
+		if( isSolverConverged( delta ) )
+			break;
 	}
+	endSolve( delta );
 }
 
 void ciMsaFluidSolver::linearSolverRGB( float a, float c )
 {
+	if( solverMethod == SOLVER_RED_BLACK )
+	{
+		linearSolverRGBRedBlack( a, c );
+		return;
+	}
+	
 	int index3, index4, index;
-	int	step_x = _NX + 2;
+	int	step_x = _rowStride;
 	c = 1. / c;
+	float delta = 0;
 	for ( int k = solverIterations; k > 0; --k )	// MEMO
 	{           
+		delta = 0;
 		for (int j = _NY; j > 0 ; --j)
+		for( const CellSpan *span = spansEnd( j ); span-- != spansBegin( j ); )
 		{
-			index = FLUID_IX(_NX, j );
+			index = FLUID_IX(span->i0 + span->n - 1, j );
 			//index1 = index - 1;		//FLUID_IX(i-1, j);
 			//index2 = index + 1;		//FLUID_IX(i+1, j);
 			index3 = index - step_x;	//FLUID_IX(i, j-1);
 			index4 = index + step_x;	//FLUID_IX(i, j+1);
-			for (int i = _NX; i > 0 ; --i)
+			for (int i = span->n; i > 0 ; --i)
 			{	
+				float oldR = r[index];
+				float oldG = g[index];
+				float oldB = b[index];
 				r[index] = ( ( r[index-1] + r[index+1]  +  r[index3] + r[index4] ) * a  +  rOld[index] ) * c;
 				g[index] = ( ( g[index-1] + g[index+1]  +  g[index3] + g[index4] ) * a  +  gOld[index] ) * c;
 				b[index] = ( ( b[index-1] + b[index+1]  +  b[index3] + b[index4] ) * a  +  bOld[index] ) * c;                                
 				//				x[FLUID_IX(i, j)] = (a * ( x[FLUID_IX(i-1, j)] + x[FLUID_IX(i+1, j)]  +  x[FLUID_IX(i, j-1)] + x[FLUID_IX(i, j+1)])  +  x0[FLUID_IX(i, j)]) / c;
+				delta = ci::math<float>::max( delta, ci::math<float>::max( fabsf( r[index] - oldR ), ci::math<float>::max( fabsf( g[index] - oldG ), fabsf( b[index] - oldB ) ) ) );
 				--index;
 				--index3;
 				--index4;
 			}
 		}
 		setBoundaryRGB();	
+		if( isSolverConverged( delta ) )
+			break;
 	}
+	endSolve( delta );
 }
 
 void ciMsaFluidSolver::linearSolverUV( float a, float c )
 {
+	if( solverMethod == SOLVER_RED_BLACK )
+	{
+		linearSolverUVRedBlack( a, c );
+		return;
+	}
+	
 	int index;
-	int	step_x = _NX + 2;
+	int	step_x = _rowStride;
 	c = 1. / c;
-	ci::Vec2f* __restrict localUV = uv;
-	const ci::Vec2f* __restrict localOldUV = uvOld;
+	float* __restrict localU = u;
+	float* __restrict localV = v;
+	const float* __restrict localOldU = uOld;
+	const float* __restrict localOldV = vOld;
 
+	float delta = 0;
 	for (int k = solverIterations; k > 0; --k)	// MEMO
 	{           
+		delta = 0;
 		for (int j = _NY; j > 0 ; --j)
 		{
-			index = FLUID_IX(_NX, j );
-			float prevU = localUV[index+1].x;
-			float prevV = localUV[index+1].y;
-			for (int i = _NX; i > 0 ; --i)
+			for( const CellSpan *span = spansEnd( j ); span-- != spansBegin( j ); )
+			{
+				index = FLUID_IX(span->i0 + span->n - 1, j );
+				float prevU = localU[index+1];
+				float prevV = localV[index+1];
+				for (int i = span->n; i > 0 ; --i)
+				{
+					prevU = ( ( localU[index-1] + prevU + localU[index - step_x] + localU[index + step_x] ) * a  + localOldU[index] ) * c;
+					prevV = ( ( localV[index-1] + prevV + localV[index - step_x] + localV[index + step_x] ) * a  + localOldV[index] ) * c;
+					delta = ci::math<float>::max( delta, ci::math<float>::max( fabsf( prevU - localU[index] ), fabsf( prevV - localV[index] ) ) );
+					localU[index] = prevU;
+					localV[index] = prevV;
+					--index;
+				}
+			}
+		}
+		setBoundary2d( 1, u, v );
+		if( isSolverConverged( delta ) )
+			break;
+	}
+	endSolve( delta );
+}
+
+// counts the sweep, returns true if the change it made is below the tolerance
+bool ciMsaFluidSolver::isSolverConverged( float delta )
+{
+	++solverIterationsUsed;
+	return delta < solverTolerance;
+}
+
+// keeps the largest final change of the solves in this update
+void ciMsaFluidSolver::endSolve( float delta )
+{
+	solverChange = ci::math<float>::max( solverChange, delta );
+}
+
+// converts a change of pressure to the change of velocity it causes in project()
+float ciMsaFluidSolver::getPressureScale() const
+{
+	return 0.5f * ci::math<int>::max( _NX, _NY );
+}
+
+// Red-black relaxation
+// cells with (i + j) even are red, the rest black. a red cell only depends on black
+// neighbours and vice versa, so all cells of one color can be updated in any order
+// and the rows are split into bands on the thread pool
+
+// first column of color in row j
+#define RB_FIRST_I( j, color )		( 1 + ( ( (j) + (color) + 1 ) & 1 ) )
+
+// the bands report the largest change they made here
+static void atomicMax( std::atomic< float > &target, float value )
+{
+	float current = target.load();
+	while( value > current && !target.compare_exchange_weak( current, value ) )
+		;
+}
+
+void ciMsaFluidSolver::linearSolverRedBlack( int bound, float* __restrict x, const float* __restrict x0, float a, float c )
+{
+	int	step_x = _rowStride;
+	c = 1. / c;
+	if( canBlockRelaxation() )
+	{
+		RelaxPlane plane = { x, x0, ( bound == 1 && !wrap_x ) ? -1 : 1, ( bound == 2 && !wrap_y ) ? -1 : 1, true };
+		endSolve( relaxBlocked( &plane, 1, a, c ) );
+		return;
+	}
+	std::atomic< float > sweepDelta( 0 );
+	
+	std::function< void ( int, int ) > sweep[2];
+	for( int color = 0; color < 2; ++color )
+	{
+		sweep[color] = [=, &sweepDelta]( int j0, int j1 )
+		{
+			float delta = 0;
+			for( int j = j0; j < j1; ++j )
 			{
-				prevU = ( ( localUV[index-1].x + prevU + localUV[index - step_x].x + localUV[index + step_x].x ) * a  + localOldUV[index].x ) * c;
-				prevV = ( ( localUV[index-1].y + prevV + localUV[index - step_x].y + localUV[index + step_x].y ) * a  + localOldUV[index].y ) * c;
-				localUV[index].x = prevU;
-				localUV[index].y = prevV;
+				int parity = RB_FIRST_I( j, color ) - 1;
+				for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+				{
+					int index = FLUID_IX( span->i0, j );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( x + index, x0 + index, span->n, step_x, a, c, parity ) );
+				}
+			}
+			atomicMax( sweepDelta, delta );
+		};
+	}
+	
+	float delta = 0;
+	for (int k = solverIterations; k > 0; --k)
+	{
+		sweepDelta = 0;
+		threadPool.parallelFor( 1, _NY + 1, sweep[0] );
+		threadPool.parallelFor( 1, _NY + 1, sweep[1] );
+		setBoundary( bound, x );
+		delta = sweepDelta;
+		if( isSolverConverged( delta ) )
+			break;
+	}
+	endSolve( delta );
+}
+
+void ciMsaFluidSolver::linearSolverProjectRedBlack( float* __restrict p, const float* __restrict div )
+{
+	int	step_x = _rowStride;
+	if( canBlockRelaxation() )
+	{
+		RelaxPlane plane = { p, div, 1, 1, true };
+		endSolve( relaxBlocked( &plane, 1, 1.0f, .25f ) * getPressureScale() );
+		return;
+	}
+	std::atomic< float > sweepDelta( 0 );
+	
+	// the kernel computes ( sum of the neighbours * a + x0 ) * c, with a = 1 this is exactly the pressure update
+	std::function< void ( int, int ) > sweep[2];
+	for( int color = 0; color < 2; ++color )
+	{
+		sweep[color] = [=, &sweepDelta]( int j0, int j1 )
+		{
+			float delta = 0;
+			for( int j = j0; j < j1; ++j )
+			{
+				int parity = RB_FIRST_I( j, color ) - 1;
+				for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+				{
+					int index = FLUID_IX( span->i0, j );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( p + index, div + index, span->n, step_x, 1.0f, .25f, parity ) );
+				}
+			}
+			atomicMax( sweepDelta, delta );
+		};
+	}
+	
+	float delta = 0;
+	for (int k = solverIterations; k > 0; --k)
+	{
+		sweepDelta = 0;
+		threadPool.parallelFor( 1, _NY + 1, sweep[0] );
+		threadPool.parallelFor( 1, _NY + 1, sweep[1] );
+		setBoundary( 0, p );
+		delta = sweepDelta * getPressureScale();
+		if( isSolverConverged( delta ) )
+			break;
+	}
+	endSolve( delta );
+}
+
+void ciMsaFluidSolver::linearSolverRGBRedBlack( float a, float c )
+{
+	int	step_x = _rowStride;
+	c = 1. / c;
+	float * __restrict lr = r;
+	float * __restrict lg = g;
+	float * __restrict lb = b;
+	const float * __restrict lrOld = rOld;
+	const float * __restrict lgOld = gOld;
+	const float * __restrict lbOld = bOld;
+	if( canBlockRelaxation() )
+	{
+		RelaxPlane planes[3] = { { r, rOld, 1, 1, false }, { g, gOld, 1, 1, false }, { b, bOld, 1, 1, false } };
+		endSolve( relaxBlocked( planes, 3, a, c ) );
+		return;
+	}
+	std::atomic< float > sweepDelta( 0 );
+	
+	std::function< void ( int, int ) > sweep[2];
+	for( int color = 0; color < 2; ++color )
+	{
+		sweep[color] = [=, &sweepDelta]( int j0, int j1 )
+		{
+			float delta = 0;
+			for( int j = j0; j < j1; ++j )
+			{
+				int parity = RB_FIRST_I( j, color ) - 1;
+				for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+				{
+					int index = FLUID_IX( span->i0, j );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( lr + index, lrOld + index, span->n, step_x, a, c, parity ) );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( lg + index, lgOld + index, span->n, step_x, a, c, parity ) );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( lb + index, lbOld + index, span->n, step_x, a, c, parity ) );
+				}
+			}
+			atomicMax( sweepDelta, delta );
+		};
+	}
+	
+	float delta = 0;
+	for ( int k = solverIterations; k > 0; --k )
+	{
+		sweepDelta = 0;
+		threadPool.parallelFor( 1, _NY + 1, sweep[0] );
+		threadPool.parallelFor( 1, _NY + 1, sweep[1] );
+		setBoundaryRGB();
+		delta = sweepDelta;
+		if( isSolverConverged( delta ) )
+			break;
+	}
+	endSolve( delta );
+}
+
+void ciMsaFluidSolver::linearSolverUVRedBlack( float a, float c )
+{
+	int	step_x = _rowStride;
+	c = 1. / c;
+	float* __restrict localU = u;
+	float* __restrict localV = v;
+	const float* __restrict localOldU = uOld;
+	const float* __restrict localOldV = vOld;
+	if( canBlockRelaxation() )
+	{
+		// as setBoundary2d( 1, u, v )
+		RelaxPlane planes[2] = { { u, uOld, wrap_x ? 1 : -1, 0, true }, { v, vOld, 0, 1, false } };
+		endSolve( relaxBlocked( planes, 2, a, c ) );
+		return;
+	}
+	std::atomic< float > sweepDelta( 0 );
+	
+	std::function< void ( int, int ) > sweep[2];
+	for( int color = 0; color < 2; ++color )
+	{
+		sweep[color] = [=, &sweepDelta]( int j0, int j1 )
+		{
+			float delta = 0;
+			for( int j = j0; j < j1; ++j )
+			{
+				int parity = RB_FIRST_I( j, color ) - 1;
+				for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+				{
+					int index = FLUID_IX( span->i0, j );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( localU + index, localOldU + index, span->n, step_x, a, c, parity ) );
+					delta = ci::math<float>::max( delta, kernels->relaxRow( localV + index, localOldV + index, span->n, step_x, a, c, parity ) );
+				}
+			}
+			atomicMax( sweepDelta, delta );
+		};
+	}
+	
+	float delta = 0;
+	for (int k = solverIterations; k > 0; --k)
+	{
+		sweepDelta = 0;
+		threadPool.parallelFor( 1, _NY + 1, sweep[0] );
+		threadPool.parallelFor( 1, _NY + 1, sweep[1] );
+		setBoundary2d( 1, u, v );
+		delta = sweepDelta;
+		if( isSolverConverged( delta ) )
+			break;
+	}
+	endSolve( delta );
+}
+
+// Cache blocking
+// the rows are split into bands that fit FLUID_BLOCK_BYTES and a pass over a band relaxes it for several
+// sweeps. each half sweep (a level) of a cell needs the level before it done in the rows next to it, so
+// in the first phase every band relaxes a trapezoid that loses a row at each end with every level, and
+// in the second phase the triangles left at the band boundaries are filled in, with their halo rows now
+// up to date on both sides. a row gets its edges after each black level and the rows of the boundary
+// those of the rows they copy, which keeps the results identical to the sweeps with setBoundary between them
+
+#define BLOCK_ROWS_PER_SWEEP	8		// rows of a band for each sweep done in one pass
+
+bool ciMsaFluidSolver::canBlockRelaxation() const
+{
+	// with a tolerance the sweeps stop after any of them, a pass can not do several
+	return doCacheBlocking && solverTolerance <= 0 && solverIterations > 0 && _NY >= 4;
+}
+
+// relaxes the cells of row j of the color of level, the black levels end a sweep and set the edges of the row
+float ciMsaFluidSolver::relaxBlockedRow( const RelaxPlane *planes, int numPlanes, int j, int level, float a, float c )
+{
+	int parity = RB_FIRST_I( j, level & 1 ) - 1;
+	float delta = 0;
+	for( int p = 0; p < numPlanes; ++p )
+	{
+		for( const CellSpan *span = spansBegin( j ); span != spansEnd( j ); ++span )
+		{
+			int index = FLUID_IX( span->i0, j );
+			delta = ci::math<float>::max( delta, kernels->relaxRow( planes[p].x + index, planes[p].x0 + index, span->n, _rowStride, a, c, parity ) );
+		}
+	}
+	
+	if( !( level & 1 ) )
+		return delta;
+	
+	for( int p = 0; p < numPlanes; ++p )
+	{
+		float *x = planes[p].x;
+		if( planes[p].edgeSign )
+		{
+			float left = x[ FLUID_IX( wrap_x ? _NX : 1, j ) ];
+			float right = x[ FLUID_IX( wrap_x ? 1 : _NX, j ) ];
+			x[ FLUID_IX( 0, j ) ] = planes[p].edgeSign < 0 ? -left : left;
+			x[ FLUID_IX( _NX + 1, j ) ] = planes[p].edgeSign < 0 ? -right : right;
+		}
+		
+		// without wrapping the top and bottom rows only depend on the rows next to them
+		if( planes[p].rowSign && !wrap_y && ( j == 1 || j == _NY ) )
+		{
+			float *dst = x + FLUID_IX( 1, j == 1 ? 0 : _NY + 1 );
+			const float *src = x + FLUID_IX( 1, j );
+			for( int i = 0; i < _NX; ++i )
+				dst[i] = planes[p].rowSign < 0 ? -src[i] : src[i];
+		}
+	}
+	return delta;
+}
+
+// does solverIterations red-black sweeps, returns the largest change of the last one
+float ciMsaFluidSolver::relaxBlocked( const RelaxPlane *planes, int numPlanes, float a, float c )
+{
+	// a band is at least twice as high as the number of levels done in a pass so the triangles don't overlap,
+	// and there is a band for each thread
+	int rowBytes = 2 * numPlanes * _rowStride * sizeof( float );
+	int numThreads = threadPool.getNumThreads();
+	int bandRows = ci::math<int>::min( FLUID_BLOCK_BYTES / rowBytes, ( _NY + numThreads - 1 ) / numThreads );
+	bandRows = ci::math<int>::max( bandRows, 4 );
+	int numBands = ci::math<int>::max( _NY / bandRows, 1 );
+	int sweepsPerPass = ci::constrain<int>( bandRows / BLOCK_ROWS_PER_SWEEP, 1, solverIterations );
+	
+	std::vector< int > bandStart( numBands + 1 );
+	for( int k = 0; k <= numBands; ++k )
+		bandStart[k] = 1 + k * _NY / numBands;
+	std::vector< unsigned char > triangleDone( numBands );
+	
+	std::atomic< float > lastDelta( 0 );
+	int levels = 0;
+	bool lastPass = false;
+	
+	// relaxes rows [j0, j1) at level, wrapping around the grid
+	auto relaxRows = [&]( int j0, int j1, int level ) -> float
+	{
+		float delta = 0;
+		for( int j = j0; j < j1; ++j )
+		{
+			int row = ( j < 1 ) ? j + _NY : ( j > _NY ) ? j - _NY : j;
+			delta = ci::math<float>::max( delta, relaxBlockedRow( planes, numPlanes, row, level, a, c ) );
+		}
+		return delta;
+	};
+	
+	// the triangle around the start of band k, k = 0 is the seam of a wrapped grid
+	auto relaxTriangle = [&]( int k )
+	{
+		float delta = 0;
+		for( int level = 1; level < levels; ++level )
+		{
+			float d = relaxRows( bandStart[k] - level, bandStart[k] + level, level );
+			if( lastPass && level >= levels - 2 )
+				delta = ci::math<float>::max( delta, d );
+			
+			// the wrapped top and bottom rows copy each other once both have finished the sweep
+			if( k == 0 && ( level & 1 ) )
+			{
+				for( int p = 0; p < numPlanes; ++p )
+				{
+					if( !planes[p].rowSign )
+						continue;
+					float *x = planes[p].x;
+					memcpy( x + FLUID_IX( 1, 0 ), x + FLUID_IX( 1, _NY ), _NX * sizeof( float ) );
+					memcpy( x + FLUID_IX( 1, _NY + 1 ), x + FLUID_IX( 1, 1 ), _NX * sizeof( float ) );
+				}
+			}
+		}
+		atomicMax( lastDelta, delta );
+		triangleDone[k] = 1;
+	};
+	
+	std::function< void ( int, int ) > relaxBands = [&]( int k0, int k1 )
+	{
+		float delta = 0;
+		for( int k = k0; k < k1; ++k )
+		{
+			int top = ( k == 0 && !wrap_y ) ? 0 : 1;
+			int bottom = ( k == numBands - 1 && !wrap_y ) ? 0 : 1;
+			for( int level = 0; level < levels; ++level )
+			{
+				float d = relaxRows( bandStart[k] + level * top, bandStart[k + 1] - level * bottom, level );
+				if( lastPass && level >= levels - 2 )
+					delta = ci::math<float>::max( delta, d );
+			}
+			
+			// the band above is done too when it was in this chunk
+			if( k > k0 )
+				relaxTriangle( k );
+		}
+		atomicMax( lastDelta, delta );
+	};
+	
+	std::function< void ( int, int ) > relaxTriangles = [&]( int k0, int k1 )
+	{
+		for( int k = k0; k < k1; ++k )
+			if( !triangleDone[k] && ( k > 0 || wrap_y ) )
+				relaxTriangle( k );
+	};
+	
+	for( int sweeps = solverIterations; sweeps > 0; sweeps -= sweepsPerPass )
+	{
+		levels = 2 * ci::math<int>::min( sweeps, sweepsPerPass );
+		lastPass = sweeps <= sweepsPerPass;
+		std::fill( triangleDone.begin(), triangleDone.end(), 0 );
+		threadPool.parallelFor( 0, numBands, relaxBands );
+		threadPool.parallelFor( 0, numBands, relaxTriangles );
+	}
+	
+	for( int p = 0; p < numPlanes; ++p )
+		if( planes[p].corners )
+			setCorners( planes[p].x );
+	
+	solverIterationsUsed += solverIterations;
+	return lastDelta;
+}
+
+// Multigrid pressure solver
+// solves the same equation as linearSolverProject, 4 * p(i, j) - sum of the neighbours = div(i, j),
+// with V-cycles on a hierarchy of cell-centered grids. the coarse grids are half the size,
+// the residual is restricted by summing the 2x2 children and the correction is interpolated back bilinearly
+
+#define MULTIGRID_MIN_SIZE			4		// stop coarsening when either dimension gets below this
+#define MULTIGRID_PRE_SMOOTH		2
+#define MULTIGRID_POST_SMOOTH		2
+#define MULTIGRID_COARSE_SMOOTH		40
+#define MULTIGRID_PARALLEL_ROWS		64		// levels with fewer rows are smoothed on the calling thread
+
+#define MG_IX( level, i, j )		( (i) + ( (level).nx + 2 ) * (j) )
+
+void ciMsaFluidSolver::setupMultigrid()
+{
+	multigridLevels.clear();
+	
+	int nx = _NX;
+	int ny = _NY;
+	for(;;)
+	{
+		MultigridLevel level;
+		level.nx = nx;
+		level.ny = ny;
+		int n = ( nx + 2 ) * ( ny + 2 );
+		level.p.assign( n, 0.0f );
+		level.rhs.assign( n, 0.0f );
+		level.res.assign( n, 0.0f );
+		multigridLevels.push_back( level );
+		
+		if( nx < 2 * MULTIGRID_MIN_SIZE || ny < 2 * MULTIGRID_MIN_SIZE )
+			break;
+		nx = ( nx + 1 ) / 2;
+		ny = ( ny + 1 ) / 2;
+	}
+}
+
+void ciMsaFluidSolver::linearSolverProjectMultigrid( float* __restrict pressure, const float* __restrict div )
+{
+	if( multigridLevels.empty() || multigridLevels[0].nx != _NX || multigridLevels[0].ny != _NY )
+		setupMultigrid();
+	
+	// the levels are not padded, copy row by row
+	MultigridLevel &fine = multigridLevels[0];
+	float * __restrict p = &fine.p[0];
+	float * __restrict rhs = &fine.rhs[0];
+	for( int j = _NY + 1; j >= 0; --j )
+	{
+		for( int i = _NX + 1; i >= 0; --i )
+		{
+			p[ MG_IX( fine, i, j ) ] = pressure[ FLUID_IX( i, j ) ];
+			rhs[ MG_IX( fine, i, j ) ] = div[ FLUID_IX( i, j ) ];
+		}
+	}
+	
+	for( int k = multigridCycles; k > 0; --k )
+		multigridVCycle( 0 );
+	
+	if( !useActiveTiles() )
+	{
+		for( int j = _NY + 1; j >= 0; --j )
+			for( int i = _NX + 1; i >= 0; --i )
+				pressure[ FLUID_IX( i, j ) ] = p[ MG_IX( fine, i, j ) ];
+		return;
+	}
+	
+	// the pressure spreads over the whole grid, only the updated cells take it so the rest stays clear
+	forEachPlaneSpan( [&]( int o, int n ) {
+		int j = o / _rowStride;
+		int i0 = o - j * _rowStride;
+		for( int i = i0; i < i0 + n; ++i )
+			pressure[ FLUID_IX( i, j ) ] = p[ MG_IX( fine, i, j ) ];
+	} );
+}
+
+void ciMsaFluidSolver::multigridVCycle( int l )
+{
+	MultigridLevel &level = multigridLevels[l];
+	
+	if( l == (int)multigridLevels.size() - 1 )
+	{
+		multigridSmooth( level, MULTIGRID_COARSE_SMOOTH );
+		return;
+	}
+	
+	MultigridLevel &coarse = multigridLevels[l + 1];
+	
+	multigridSmooth( level, MULTIGRID_PRE_SMOOTH );
+	multigridResidual( level );
+	multigridRestrict( level, coarse );
+	
+	std::fill( coarse.p.begin(), coarse.p.end(), 0.0f );
+	multigridVCycle( l + 1 );
+	
+	multigridProlongate( coarse, level );
+	multigridSmooth( level, MULTIGRID_POST_SMOOTH );
+}
+
+void ciMsaFluidSolver::multigridSmooth( MultigridLevel &level, int iterations )
+{
+	float * __restrict p = &level.p[0];
+	const float * __restrict rhs = &level.rhs[0];
+	int nx = level.nx;
+	int step_x = nx + 2;
+	
+	std::function< void ( int, int ) > sweep[2];
+	for( int color = 0; color < 2; ++color )
+	{
+		sweep[color] = [=]( int j0, int j1 )
+		{
+			for( int j = j0; j < j1; ++j )
+			{
+				int index = RB_FIRST_I( j, color ) + step_x * j;
+				int end = nx + 1 + step_x * j;
+				for( ; index < end; index += 2 )
+					p[index] = ( p[index-1] + p[index+1] + p[index - step_x] + p[index + step_x] + rhs[index] ) * .25f;
+			}
+		};
+	}
+	
+	bool parallel = level.ny >= MULTIGRID_PARALLEL_ROWS;
+	for( int k = iterations; k > 0; --k )
+	{
+		for( int color = 0; color < 2; ++color )
+		{
+			if( parallel )
+				threadPool.parallelFor( 1, level.ny + 1, sweep[color] );
+			else
+				sweep[color]( 1, level.ny + 1 );
+		}
+		setBoundaryMultigrid( level, p );
+	}
+}
+
+void ciMsaFluidSolver::multigridResidual( MultigridLevel &level )
+{
+	const float * __restrict p = &level.p[0];
+	const float * __restrict rhs = &level.rhs[0];
+	float * __restrict res = &level.res[0];
+	int nx = level.nx;
+	int step_x = nx + 2;
+	
+	std::function< void ( int, int ) > residual = [=]( int j0, int j1 )
+	{
+		for( int j = j0; j < j1; ++j )
+		{
+			int index = 1 + step_x * j;
+			int end = nx + 1 + step_x * j;
+			for( ; index < end; ++index )
+				res[index] = rhs[index] - ( 4 * p[index] - p[index-1] - p[index+1] - p[index - step_x] - p[index + step_x] );
+		}
+	};
+	
+	if( level.ny >= MULTIGRID_PARALLEL_ROWS )
+		threadPool.parallelFor( 1, level.ny + 1, residual );
+	else
+		residual( 1, level.ny + 1 );
+}
+
+void ciMsaFluidSolver::multigridRestrict( const MultigridLevel &fine, MultigridLevel &coarse )
+{
+	// coarse cell (I, J) covers fine cells 2I-1..2I, 2J-1..2J. the coarse equation has twice the spacing,
+	// which scales the right hand side by 4, so it is the sum of the children. if a fine dimension is odd
+	// the last coarse cell has missing children, they count as cells without residual. scaling the sum up
+	// for them makes the cycles diverge on odd grids
+	const float *res = &fine.res[0];
+	float *rhs = &coarse.rhs[0];
+	for( int J = 1; J <= coarse.ny; ++J )
+	{
+		int j0 = 2 * J - 1;
+		int j1 = ci::math<int>::min( 2 * J, fine.ny );
+		for( int I = 1; I <= coarse.nx; ++I )
+		{
+			int i0 = 2 * I - 1;
+			int i1 = ci::math<int>::min( 2 * I, fine.nx );
+			float sum = 0;
+			for( int j = j0; j <= j1; ++j )
+			{
+				for( int i = i0; i <= i1; ++i )
+					sum += res[ MG_IX( fine, i, j ) ];
+			}
+			rhs[ MG_IX( coarse, I, J ) ] = sum;
+		}
+	}
+}
+
+void ciMsaFluidSolver::multigridProlongate( const MultigridLevel &coarse, MultigridLevel &fine )
+{
+	// bilinear interpolation between cell centers, each fine cell gets 9/16 of its parent,
+	// 3/16 of the two closest neighbours of the parent and 1/16 of the diagonal one
+	// the smoothing that ends every cycle on the coarse level has set its boundary
+	const float *e = &coarse.p[0];
+	float *p = &fine.p[0];
+	
+	for( int j = 1; j <= fine.ny; ++j )
+	{
+		int J = ( j + 1 ) / 2;
+		int dj = ( j & 1 ) ? -1 : 1;
+		for( int i = 1; i <= fine.nx; ++i )
+		{
+			int I = ( i + 1 ) / 2;
+			int di = ( i & 1 ) ? -1 : 1;
+			p[ MG_IX( fine, i, j ) ] += .5625f * e[ MG_IX( coarse, I, J ) ]
+										+ .1875f * ( e[ MG_IX( coarse, I + di, J ) ] + e[ MG_IX( coarse, I, J + dj ) ] )
+										+ .0625f * e[ MG_IX( coarse, I + di, J + dj ) ];
+		}
+	}
+	setBoundaryMultigrid( fine, p );
+}
+
+// same boundary as setBoundary( 0, x ), mirrored or wrapped edges
+void ciMsaFluidSolver::setBoundaryMultigrid( const MultigridLevel &level, float *x )
+{
+	int nx = level.nx;
+	int ny = level.ny;
+	
+	for( int j = 1; j <= ny; ++j )
+	{
+		x[ MG_IX( level, 0, j ) ] = x[ MG_IX( level, wrap_x ? nx : 1, j ) ];
+		x[ MG_IX( level, nx + 1, j ) ] = x[ MG_IX( level, wrap_x ? 1 : nx, j ) ];
+	}
+	for( int i = 1; i <= nx; ++i )
+	{
+		x[ MG_IX( level, i, 0 ) ] = x[ MG_IX( level, i, wrap_y ? ny : 1 ) ];
+		x[ MG_IX( level, i, ny + 1 ) ] = x[ MG_IX( level, i, wrap_y ? 1 : ny ) ];
+	}
+	
+	x[ MG_IX( level, 0, 0 ) ] = 0.5f * ( x[ MG_IX( level, 1, 0 ) ] + x[ MG_IX( level, 0, 1 ) ] );
+	x[ MG_IX( level, 0, ny + 1 ) ] = 0.5f * ( x[ MG_IX( level, 1, ny + 1 ) ] + x[ MG_IX( level, 0, ny ) ] );
+	x[ MG_IX( level, nx + 1, 0 ) ] = 0.5f * ( x[ MG_IX( level, nx, 0 ) ] + x[ MG_IX( level, nx + 1, 1 ) ] );
+	x[ MG_IX( level, nx + 1, ny + 1 ) ] = 0.5f * ( x[ MG_IX( level, nx, ny + 1 ) ] + x[ MG_IX( level, nx + 1, ny ) ] );
+}
+
+// rms residual of the pressure equation with the divergence of x, y as the right-hand side, which is
+// what multigrid solves. the relaxation only smooths the divergence and stays far from it
+float ciMsaFluidSolver::calcProjectionResidual( const float *p, const float *x, const float *y ) const
+{
+	int	step_x = _rowStride;
+	float h = - 0.5f / _NX;
+	double sum = 0;
+	for( int j = _NY; j > 0; --j )
+	{
+		for( const CellSpan *span = spansEnd( j ); span-- != spansBegin( j ); )
+		{
+			int index = FLUID_IX( span->i0 + span->n - 1, j );
+			for( int i = span->n; i > 0; --i )
+			{
+				float div = h * ( x[index+1] - x[index-1] + y[index+step_x] - y[index-step_x] );
+				float res = div - ( 4 * p[index] - p[index-1] - p[index+1] - p[index - step_x] - p[index + step_x] );
+				sum += res * res;
 				--index;
 			}
 		}
-		setBoundary2d( 1, uv );
 	}
+	return (float)sqrt( sum / ( _NX * _NY ) );
 }
 
 // specifies simple boundry conditions.
@@ -815,48 +2371,21 @@ void ciMsaFluidSolver::setBoundary(int bound, float* x)
 			x[dst2++] = x[src2++];	
 		}
 	
+	setCorners( x );
+}
+
+// averages the two edges next to each corner
+void ciMsaFluidSolver::setCorners(float* x)
+{
 	x[FLUID_IX(  0,   0)] = 0.5f * (x[FLUID_IX(1, 0  )] + x[FLUID_IX(  0, 1)]);
 	x[FLUID_IX(  0, _NY+1)] = 0.5f * (x[FLUID_IX(1, _NY+1)] + x[FLUID_IX(  0, _NY)]);
 	x[FLUID_IX(_NX+1,   0)] = 0.5f * (x[FLUID_IX(_NX, 0  )] + x[FLUID_IX(_NX+1, 1)]);
 	x[FLUID_IX(_NX+1, _NY+1)] = 0.5f * (x[FLUID_IX(_NX, _NY+1)] + x[FLUID_IX(_NX+1, _NY)]);
 }
 
-void ciMsaFluidSolver::setBoundary02d(ci::Vec2f* x)
-{
-	int dst1, dst2, src1, src2;
-	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
-
-	dst1 = FLUID_IX(0, 1);
-	src1 = FLUID_IX(1, 1);
-	dst2 = FLUID_IX(_NX+1, 1 );
-	src2 = FLUID_IX(_NX, 1);
-	if( wrap_x )
-		SWAP( src1, src2 );
-	for (int i = _NY; i > 0; --i )
-	{
-		x[dst1].x = x[src1].x;	dst1 += step;	src1 += step;	
-		x[dst2].x = x[src2].x;	dst2 += step;	src2 += step;	
-	}
-
-	dst1 = FLUID_IX(1, 0);
-	src1 = FLUID_IX(1, 1);
-	dst2 = FLUID_IX(1, _NY+1);
-	src2 = FLUID_IX(1, _NY);
-	if( wrap_y )
-		SWAP( src1, src2 );
-	for (int i = _NX; i > 0; --i )
-	{
-		x[dst1++] = x[src1++];
-		x[dst2++] = x[src2++];	
-	}
-	
-	x[FLUID_IX(  0,   0)].x = 0.5f * (x[FLUID_IX(1, 0  )].x + x[FLUID_IX(  0, 1)].x);
-	x[FLUID_IX(  0, _NY+1)].x = 0.5f * (x[FLUID_IX(1, _NY+1)].x + x[FLUID_IX(  0, _NY)].x);
-	x[FLUID_IX(_NX+1,   0)].x = 0.5f * (x[FLUID_IX(_NX, 0  )].x + x[FLUID_IX(_NX+1, 1)].x);
-	x[FLUID_IX(_NX+1, _NY+1)].x = 0.5f * (x[FLUID_IX(_NX, _NY+1)].x + x[FLUID_IX(_NX+1, _NY)].x);
-}
-
-void ciMsaFluidSolver::setBoundary2d( int bound, ci::Vec2f *xy )
+// bound 1 sets the left and right edges of u, bound 2 the top and bottom edges of v, the other
+// edges are copied as they were with the interleaved velocity
+void ciMsaFluidSolver::setBoundary2d( int bound, float *u, float *v )
 {
 	int dst1, dst2, src1, src2;
 	int step = FLUID_IX(0, 1) - FLUID_IX(0, 0);
@@ -870,14 +2399,14 @@ void ciMsaFluidSolver::setBoundary2d( int bound, ci::Vec2f *xy )
 	if( bound == 1 && !wrap_x )
 		for (int i = _NY; i > 0; --i )
 		{
-			xy[dst1].x = -xy[src1].x;	dst1 += step;	src1 += step;	
-			xy[dst2].x = -xy[src2].x;	dst2 += step;	src2 += step;	
+			u[dst1] = -u[src1];	dst1 += step;	src1 += step;	
+			u[dst2] = -u[src2];	dst2 += step;	src2 += step;	
 		}
 	else
 		for (int i = _NY; i > 0; --i )
 		{
-			xy[dst1].x = xy[src1].x;	dst1 += step;	src1 += step;	
-			xy[dst2].x = xy[src2].x;	dst2 += step;	src2 += step;	
+			u[dst1] = u[src1];	dst1 += step;	src1 += step;	
+			u[dst2] = u[src2];	dst2 += step;	src2 += step;	
 		}
 
 	dst1 = FLUID_IX(1, 0);
@@ -889,20 +2418,17 @@ void ciMsaFluidSolver::setBoundary2d( int bound, ci::Vec2f *xy )
 	if( bound == 2 && !wrap_y )
 		for (int i = _NX; i > 0; --i )
 		{
-			xy[dst1++].y = -xy[src1++].y;	
-			xy[dst2++].y = -xy[src2++].y;	
+			v[dst1++] = -v[src1++];	
+			v[dst2++] = -v[src2++];	
 		}
 	else
 		for (int i = _NX; i > 0; --i )
 		{
-			xy[dst1++].y = xy[src1++].y;
-			xy[dst2++].y = xy[src2++].y;	
+			v[dst1++] = v[src1++];
+			v[dst2++] = v[src2++];	
 		}
 	
-	xy[FLUID_IX(  0,   0)][bound-1] = 0.5f * (xy[FLUID_IX(1, 0  )][bound-1] + xy[FLUID_IX(  0, 1)][bound-1]);
-	xy[FLUID_IX(  0, _NY+1)][bound-1] = 0.5f * (xy[FLUID_IX(1, _NY+1)][bound-1] + xy[FLUID_IX(  0, _NY)][bound-1]);
-	xy[FLUID_IX(_NX+1,   0)][bound-1] = 0.5f * (xy[FLUID_IX(_NX, 0  )][bound-1] + xy[FLUID_IX(_NX+1, 1)][bound-1]);
-	xy[FLUID_IX(_NX+1, _NY+1)][bound-1] = 0.5f * (xy[FLUID_IX(_NX, _NY+1)][bound-1] + xy[FLUID_IX(_NX+1, _NY)][bound-1]);
+	setCorners( bound == 1 ? u : v );
 }
 
 #define CPY_RGB( d, s )		{	r[d] = r[s];	g[d] = g[s];	b[d] = b[s]; }
@@ -946,11 +2472,20 @@ void ciMsaFluidSolver::setBoundaryRGB()
 }
 
 void ciMsaFluidSolver::randomizeColor() {
+	activeTiles.assign( activeTiles.size(), 1 );
 	for (int i = getWidth()-1; i > 0; --i)
 	{
 		for (int j = getHeight()-1; j > 0; --j)
 		{
 			int index = FLUID_IX(i, j);
+			if(doFixedColor) {
+				rFixed[index] = rFixedOld[index] = toFixedColor( ci::Rand::randFloat() );
+				if(doRGB) {
+					gFixed[index] = gFixedOld[index] = toFixedColor( ci::Rand::randFloat() );
+					bFixed[index] = bFixedOld[index] = toFixedColor( ci::Rand::randFloat() );
+				}
+				continue;
+			}
 			r[index] = rOld[index] = ci::Rand::randFloat();
 			if(doRGB) {
 				g[index] = gOld[index] = ci::Rand::randFloat();
@@ -0,0 +1,113 @@
+/***********************************************************************
+
+ Small persistent worker pool used by ciMsaFluidSolver to split grid
+ sweeps into row bands.
+
+ ***********************************************************************/
+
+#include <algorithm>
+
+#include "ciMsaFluidKernels.h"
+#include "ciMsaFluidThreadPool.h"
+
+// number of polls a worker does before going to sleep on the condition variable,
+// the solver dispatches a few hundred jobs per frame so waking up from the kernel each time is too slow
+#define	THREADPOOL_SPIN_COUNT	4000
+
+ciMsaFluidThreadPool::ciMsaFluidThreadPool()
+:generation(0)
+,pending(0)
+,quit(false)
+,job(NULL)
+,jobBegin(0)
+,jobEnd(0)
+,jobFlushDenormals(false)
+{
+}
+
+ciMsaFluidThreadPool::~ciMsaFluidThreadPool() {
+	stop();
+}
+
+void ciMsaFluidThreadPool::setNumThreads( int numThreads ) {
+	if( numThreads <= 0 )
+		numThreads = std::max( 1, (int)std::thread::hardware_concurrency() );
+
+	if( numThreads == getNumThreads() )
+		return;
+
+	stop();
+
+	// workers wait for the job after the current generation, reading it in workerFn
+	// instead could skip a job dispatched before the thread got scheduled
+	quit.store( false );
+	unsigned current = generation.load();
+	for( int i = 1; i < numThreads; ++i )
+		workers.push_back( std::thread( std::bind( &ciMsaFluidThreadPool::workerFn, this, i, current ) ) );
+}
+
+void ciMsaFluidThreadPool::stop() {
+	{
+		std::lock_guard< std::mutex > lock( mutex );
+		quit.store( true );
+	}
+	cond.notify_all();
+
+	for( size_t i = 0; i < workers.size(); ++i )
+		workers[i].join();
+	workers.clear();
+}
+
+void ciMsaFluidThreadPool::parallelFor( int begin, int end, const std::function< void ( int, int ) > &fn ) {
+	int numChunks = getNumThreads();
+	if( numChunks == 1 || end - begin < numChunks ) {
+		fn( begin, end );
+		return;
+	}
+
+	job = &fn;
+	jobBegin = begin;
+	jobEnd = end;
+	jobFlushDenormals = ciMsaFluidDenormalGuard::isEnabled();
+	pending.store( numChunks - 1 );
+	{
+		std::lock_guard< std::mutex > lock( mutex );
+		generation.fetch_add( 1, std::memory_order_release );
+	}
+	cond.notify_all();
+
+	// the calling thread takes the first chunk
+	fn( begin, begin + ( end - begin ) / numChunks );
+
+	while( pending.load( std::memory_order_acquire ) > 0 )
+		std::this_thread::yield();
+}
+
+void ciMsaFluidThreadPool::workerFn( int chunk, unsigned seen ) {
+	for(;;) {
+		for( int spin = THREADPOOL_SPIN_COUNT; spin > 0 && generation.load( std::memory_order_acquire ) == seen; --spin )
+			std::this_thread::yield();
+
+		if( generation.load( std::memory_order_acquire ) == seen ) {
+			std::unique_lock< std::mutex > lock( mutex );
+			while( !quit && generation.load( std::memory_order_acquire ) == seen )
+				cond.wait( lock );
+		}
+		if( quit )
+			return;
+
+		seen = generation.load( std::memory_order_acquire );
+
+		int numChunks = getNumThreads();
+		int range = jobEnd - jobBegin;
+		int chunkBegin = jobBegin + (int)( (long long)range * chunk / numChunks );
+		int chunkEnd = jobBegin + (int)( (long long)range * ( chunk + 1 ) / numChunks );
+		{
+			// the chunk runs with denormals flushed when the calling thread has them flushed
+			ciMsaFluidDenormalGuard denormals( jobFlushDenormals );
+			(*job)( chunkBegin, chunkEnd );
+		}
+
+		pending.fetch_sub( 1, std::memory_order_release );
+	}
+}
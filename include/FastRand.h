@@ -0,0 +1,63 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "cinder/Vector.h"
+
+//! Small seedable random number generator for the jitter of the particles,
+//! in place of the shared generator behind ci::Rand. Four xorshift128
+//! streams are stepped together, with SSE2 where available, and handed out
+//! in turn, so a batch from nextFloats() is the same as the numbers one at a
+//! time. A seed gives the same numbers on every platform. An instance is
+//! meant for one thread.
+class FastRand
+{
+	public:
+		FastRand( uint32_t seed = 1 );
+
+		void seed( uint32_t seed );
+
+		uint32_t nextUint()
+		{
+			if ( mIndex == 4 )
+				step();
+			return mBuffer[ mIndex++ ];
+		}
+		//! Number in [0, 1).
+		float nextFloat() { return toFloat( nextUint() ); }
+		float nextFloat( float min, float max ) { return min + ( max - min ) * nextFloat(); }
+		//! Integer in [min, max).
+		int nextInt( int min, int max );
+		//! Unit vector at a random angle.
+		ci::Vec2f nextVec2f();
+
+		//! Fills \a floats with \a n numbers in [0, 1).
+		void nextFloats( float *floats, int n );
+
+	private:
+		static float toFloat( uint32_t u ) { return ( u >> 8 ) * ( 1.0f / 16777216.0f ); }
+
+		//! Steps the four streams into mBuffer.
+		void step();
+
+		uint32_t mX[ 4 ], mY[ 4 ], mZ[ 4 ], mW[ 4 ];
+		uint32_t mBuffer[ 4 ];
+		int mIndex;
+};
@@ -0,0 +1,60 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+
+//! Picks the width of the fluid grid from a list of presets so the solver
+//! stays within a time budget. The solver time of the steps is averaged, the
+//! grid steps down when the average is over the budget and up when the next
+//! preset is estimated to fit with headroom to spare. After a change the
+//! average starts over at the new size before the next decision.
+class FluidQuality
+{
+	public:
+		//! Starts with presets of 64, 96, 128 and 192 cells at 128 and a budget of 8 ms.
+		FluidQuality();
+
+		//! Grid widths in cells, from the cheapest to the finest.
+		void setPresets( const std::vector< int > &widths );
+		void setPreset( int index );
+		int getPreset() const { return mPreset; }
+		int getNumPresets() const { return (int)mPresets.size(); }
+		//! Width in cells of the current preset.
+		int getWidth() const { return mPresets[ mPreset ]; }
+
+		//! Seconds of solver time per step to stay within.
+		void setBudget( double seconds ) { mBudget = seconds; }
+		double getBudget() const { return mBudget; }
+
+		//! Takes the solver seconds of the last step, returns true if the preset changed.
+		bool update( double solverSeconds );
+		//! Average solver seconds per step at the current preset.
+		double getAverage() const { return mAverage; }
+
+	private:
+		std::vector< int > mPresets;
+		int mPreset;
+		double mBudget;
+		double mAverage;
+		int mSamples;
+
+		static const double sSmoothing;
+		static const double sHeadroom;
+		static const int sSettleSamples;
+};
@@ -1,41 +1,29 @@
 #pragma once
 
+#include <vector>
+
 #include "cinder/Vector.h"
 #include "cinder/Color.h"
-
 #include "ciMsaFluidSolver.h"
 
-class Particle
-{
-	public:
-		Particle();
-		Particle( const ci::Vec2f &pos );
-
-		void update( double time, const ciMsaFluidSolver *solver, const ci::Vec2f &windowSize, const ci::Vec2f &invWindowSize, float *positions, float *colors );
-		bool isAlive() { return mLifeSpan > 0; }
-
-	private:
-		ci::Vec2f mPos;
-		ci::Vec2f mVel;
-		ci::ColorA mColor;
-
-		float mSize;
-		float mLifeSpan;
-		float mMass;
-
-		static const float sMomentum;
-		static const float sFluidForce;
-};
+#include "FastRand.h"
+#include "StreamingVbo.h"
 
 class ParticleManager
 {
 	public:
-		ParticleManager();
+		//! Room for \a capacity particles, resizable with setCapacity().
+		ParticleManager( int capacity = 16384 );
 
 		void setWindowSize( ci::Vec2i winSize );
 		void setFluidSolver( const ciMsaFluidSolver *aSolver ) { mSolver = aSolver; }
 
+		//! Updates the particles into the back buffer.
 		void update( double seconds );
+		//! Makes the particles of the last update the ones drawn.
+		void swapBuffers();
+		//! Draws the particles at \a alpha of the way from their previous to their current position.
+		void setInterpolation( float alpha ) { mInterpolation = alpha; }
 		void draw();
 
 		void addParticle( const ci::Vec2f &pos, int count = 1 );
@@ -43,6 +31,30 @@ class ParticleManager
 		static float getAging() { return sAging; }
 		static void setAging( float a ) { sAging = a; }
 
+		//! Number of live particles.
+		int getNumParticles() const { return mCount; }
+
+		//! Reallocates the particles for \a capacity of them. Going below the
+		//! number alive drops the newest ones. Not while an update is running.
+		void setCapacity( int capacity );
+		int getCapacity() const { return mCapacity; }
+		//! Bytes held by the particles and their vertex buffers, the buffer objects included.
+		size_t getMemoryUsage() const;
+
+		//! Streams the vertices through a ring of buffer objects the update writes
+		//! into directly, in the best mode up to \a maxMode the GL supports. Off
+		//! or without buffer objects they are drawn from client memory. Needs the
+		//! GL context and no update running, the particles drawn last are dropped.
+		void enableStreaming( bool enable, StreamingVbo::Mode maxMode = StreamingVbo::MODE_PERSISTENT );
+		StreamingVbo::Mode getStreamingMode() const { return mVbo.getMode(); }
+
+		//! Seeds the random numbers of the particles, the same seed and input give the same particles.
+		void setSeed( uint32_t seed );
+
+		//! Threads of the update, 0 uses the hardware concurrency. The result does not depend on it.
+		void setNumThreads( int numThreads ) { mThreadPool.setNumThreads( numThreads ); }
+		int getNumThreads() const { return mThreadPool.getNumThreads(); }
+
 	private:
 		ci::Vec2i mWindowSize;
 		ci::Vec2f mInvWindowSize;
@@ -50,14 +62,78 @@ class ParticleManager
 		const ciMsaFluidSolver *mSolver;
 
 		static float sAging;
+		static const float sMomentum;
+		static const float sFluidForce;
 
-#define MAX_PARTICLES 16384 // pow 2!
+#define PARTICLE_CHUNK 1024 // particles per chunk of the update, fixed so the result does not depend on the threads
+
+		// attributes of the particles, one plane each
+		struct Store
+		{
+			std::vector< float > mX;
+			std::vector< float > mY;
+			std::vector< float > mVx;
+			std::vector< float > mVy;
+			std::vector< float > mLife;
+			std::vector< float > mMass;
+
+			void resize( int capacity );
+		};
+
+		// moves and ages the particles of chunk c, returns the number still alive
+		int moveChunk( int c );
+		// copies the live particles of chunk c to the other store from offset on and writes their vertices there
+		void packChunk( int c, int offset, int back );
+		// writes the front positions moved back towards the previous ones for the interpolation
+		void interpolate( float *positions ) const;
+		// seed of the random numbers of chunk c in pass of the current step
+		uint32_t chunkSeed( int c, int pass ) const;
+
+		// spawns the particles, the chunks of the update have their own
+		FastRand mRand;
+		uint32_t mSeed;
+
+		int mCapacity;
+		// slot replaced by the next particle when all of them are alive
 		int mCurrent;
-		int mActive;
 
-		float mPositions[ MAX_PARTICLES * 2 * 2 ];
-		float mColors[ MAX_PARTICLES * 4 * 2 ];
-		Particle mParticles[ MAX_PARTICLES ];
+		// the mCount live particles are packed at the front of mStores[ mStore ]. the update
+		// packs the ones that survive into the other store, each chunk at the offset given
+		// by the live particles of the chunks before it
+		int mCount;
+		int mStore;
+		Store mStores[ 2 ];
+		std::vector< int > mChunkLive;
+		std::vector< int > mChunkOffset;
+		unsigned mStep;
+
+		ciMsaFluidThreadPool mThreadPool;
+
+		// vertex buffers, draw() reads mFront while update() writes the other one
+		int mFront;
+		int mActive[ 2 ];
+		std::vector< float > mPositions[ 2 ];
+		std::vector< float > mPrevPositions[ 2 ];
+		std::vector< float > mColors[ 2 ];
+
+		float mInterpolation;
+		std::vector< float > mDrawPositions;
+
+		// with streaming the update writes the vertices to the mapped slot of mVbo, the positions
+		// and colors of mCapacity particles one after the other, and the positions to client
+		// memory as well for the interpolation. interpolated positions go through mDrawVbo
+		void setupStreaming();
+		StreamingVbo::Mode mStreamMode;
+		StreamingVbo mVbo;
+		StreamingVbo mDrawVbo;
+		float *mStreamVertices;
+		bool mStreamed[ 2 ];
+
+		// normalized positions of the particles and the fluid velocity there, sampled in one batch
+		std::vector< float > mSampleX;
+		std::vector< float > mSampleY;
+		std::vector< float > mSampleU;
+		std::vector< float > mSampleV;
 };
 
 
@@ -0,0 +1,100 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+
+#include "cinder/Thread.h"
+#include "cinder/Vector.h"
+
+#include "ciMsaFluidSolver.h"
+#include "Particles.h"
+
+//! Steps the fluid solver and the particles, either on the calling thread or
+//! on a background thread overlapping with drawing. Forces and particles are
+//! queued and applied at the start of the next step, the forces as solver splats.
+//! With a fixed timestep the frame time is accumulated and consumed in steps
+//! of constant length, the particles are drawn interpolated between the last
+//! two steps.
+class Simulation
+{
+	public:
+		Simulation();
+		~Simulation();
+
+		void setup( ciMsaFluidSolver *solver, ParticleManager *particles );
+
+		//! Runs the steps on a background thread. The particles drawn lag one step behind then.
+		void enableThread( bool enable );
+		bool isThreaded() const { return mThread.joinable(); }
+
+		//! Steps \a rate times a second independently of the frame rate, at most
+		//! \a maxSubsteps per update, the rest of a long frame is dropped.
+		void setFixedTimestep( bool enable, double rate = 60., int maxSubsteps = 4 );
+		bool isFixedTimestep() const { return mFixedTimestep; }
+		//! Number of steps run by the last update.
+		int getNumSubsteps() const { return mNumSubsteps; }
+		//! Seconds the solver took per step in the last step published, threaded
+		//! it is the step that finished by the last sync().
+		double getSolverSeconds() const { return mSolverSeconds; }
+
+		//! Spreads \a force over \a radius, a fraction of the width, a single cell by default.
+		void addForce( const ci::Vec2f &pos, const ci::Vec2f &force, float radius = 0 );
+		void addParticles( const ci::Vec2f &pos, int count );
+
+		//! Waits for the step in progress and publishes its particles for drawing.
+		//! The solver and the particle manager can be changed until the next update.
+		void sync();
+
+		//! Starts the steps due at \a seconds of elapsed time, threaded it returns immediately.
+		void update( double seconds );
+
+	private:
+		void step( double seconds, int steps );
+		void threadFn();
+
+		ciMsaFluidSolver *mSolver;
+		ParticleManager *mParticles;
+
+		struct Emitter
+		{
+			ci::Vec2f mPos;
+			int mCount;
+		};
+
+		std::mutex mQueueMutex;
+		std::vector< Emitter > mEmitters;
+
+		std::thread mThread;
+		std::mutex mStepMutex;
+		std::condition_variable mStepCond;
+		bool mStepPending;
+		bool mStepDone;
+		bool mThreadShouldQuit;
+		double mStepSeconds;
+		int mStepCount;
+		float mStepAlpha;
+
+		bool mFixedTimestep;
+		double mStepDuration;
+		int mMaxSubsteps;
+		int mNumSubsteps;
+		double mSolverSeconds;
+		double mAccumulator;
+		double mLastSeconds;
+};
@@ -0,0 +1,81 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+#include "cinder/gl/gl.h"
+
+//! Ring of three buffer objects for vertex data written anew every frame.
+//! The next slot is mapped for writing while the last one written is drawn,
+//! and the GPU can still be reading the one before that. Where the GL has
+//! ARB_buffer_storage the slots share one buffer that stays mapped, with a
+//! fence keeping a slot from being written before the GPU is done with it.
+//! Otherwise each slot is orphaned and mapped again. The memory of a mapped
+//! slot can be written from any thread, everything else has to be called on
+//! the thread of the GL context.
+class StreamingVbo
+{
+	public:
+		enum Mode
+		{
+			MODE_NONE,			//!< no buffer objects, draw from client memory
+			MODE_ORPHAN,		//!< a buffer per slot, orphaned and mapped for every write
+			MODE_PERSISTENT		//!< one persistently mapped buffer, the slots fenced
+		};
+
+		StreamingVbo();
+		~StreamingVbo();
+
+		//! Allocates slots of \a slotBytes in the best mode up to \a maxMode the GL supports and returns it.
+		Mode setup( size_t slotBytes, Mode maxMode = MODE_PERSISTENT );
+		void clear();
+
+		Mode getMode() const { return mMode; }
+		static const char *getModeName( Mode mode );
+
+		//! Maps the next slot for writing, waiting for the GPU if it still reads from it. NULL in MODE_NONE.
+		void *map();
+		//! Ends the writes to the mapped slot, which is drawn from then on.
+		//! Returns false if the GL lost its contents.
+		bool unmap();
+
+		//! Binds the slot drawn from as the GL_ARRAY_BUFFER and returns the
+		//! offset of its start for the gl*Pointer calls.
+		size_t bind();
+		void unbind();
+		//! Keeps the slot drawn from from being written again before the draws issued so far are done.
+		void fence();
+
+		size_t getMemoryUsage() const { return mMode == MODE_NONE ? 0 : sNumSlots * mSlotBytes; }
+
+	private:
+		static const int sNumSlots = 3;
+
+		Mode mMode;
+		size_t mSlotBytes;
+		GLuint mBuffers[ sNumSlots ];
+		void *mFences[ sNumSlots ];		// GLsync of the last draw from each slot
+		char *mPersistent;
+		bool mMapRange;
+		int mMapped;
+		int mDrawn;
+
+		StreamingVbo( const StreamingVbo & );
+		StreamingVbo &operator=( const StreamingVbo & );
+};
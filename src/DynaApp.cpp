@@ -40,10 +40,12 @@
 #include "CiNI.h"
 
 #include "DynaStroke.h"
+#include "FluidQuality.h"
 #include "Gallery.h"
 #include "HandCursor.h"
 #include "Particles.h"
 #include "PParams.h"
+#include "Simulation.h"
 #include "Utils.h"
 #include "TimerDisplay.h"
 
@@ -111,6 +113,8 @@ class DynaApp : public AppBasic, mndl::ni::UserTracker::Listener
 
 		int mParticleMin;
 		int mParticleMax;
+		int mParticleCapacity;
+		bool mParticleStreaming;
 		float mMaxVelocity;
 		float mVelParticleMult;
 		float mVelParticleMin;
@@ -118,7 +122,34 @@ class DynaApp : public AppBasic, mndl::ni::UserTracker::Listener
 
 		ciMsaFluidSolver mFluidSolver;
 		ciMsaFluidDrawerGl mFluidDrawer;
-		static const int sFluidSizeX = 128;
+		FluidQuality mFluidQuality;
+		int mFluidPreset;
+		bool mFluidAutoResolution;
+		float mFluidBudget;
+		int mFluidSizeX;
+		float mFluidSolverMs;
+		bool mFluidRedBlack;
+		bool mFluidMultigrid;
+		bool mFluidMacCormack;
+		bool mFluidFixedColor;
+		float mFluidForceRadius;
+		int mFluidThreads;
+		bool mFluidSimd;
+		float mFluidTolerance;
+		bool mFluidActiveTiles;
+		int mFluidActiveTileCount;
+		int mFluidMemoryKb;
+		int mParticleCount;
+		int mParticleMemoryKb;
+		std::string mParticleUpload;
+		bool mFluidCacheBlocking;
+		int mFluidIterationsUsed;
+		float mFluidChange;
+		bool mSimulationThread;
+		bool mFixedTimestep;
+		float mSimulationRate;
+		int mMaxSubsteps;
+		int mSubsteps;
 
 		#define SCREENSHOT_FOLDER "screenshots/"
 		#define WATERMARKED_FOLDER "watermarked/"
@@ -143,6 +174,7 @@ class DynaApp : public AppBasic, mndl::ni::UserTracker::Listener
 		void addToFluid( Vec2f pos, Vec2f vel, bool addParticles, bool addForce );
 
 		ParticleManager mParticles;
+		Simulation mSimulation;
 
 		ci::Vec2i mPrevMouse;
 
@@ -288,6 +320,8 @@ DynaApp::DynaApp() :
 	mMaxVelocity( 40 ),
 	mParticleMin( 0 ),
 	mParticleMax( 40 ),
+	mParticleCapacity( 16384 ),
+	mParticleStreaming( true ),
 	mVelParticleMult( .26 ),
 	mVelParticleMin( 1 ),
 	mVelParticleMax( 60 ),
@@ -307,6 +341,33 @@ DynaApp::DynaApp() :
 	mHandTransparencyCoeff( 465. ),
 	mState( STATE_IDLE ),
 	mShowHands( true ),
+	mFluidPreset( 2 ),
+	mFluidAutoResolution( false ),
+	mFluidBudget( 8.f ),
+	mFluidSizeX( 0 ),
+	mFluidSolverMs( 0 ),
+	mFluidRedBlack( true ),
+	mFluidMultigrid( false ),
+	mFluidMacCormack( false ),
+	mFluidFixedColor( false ),
+	mFluidForceRadius( 0.015f ),
+	mFluidThreads( 0 ),
+	mFluidSimd( true ),
+	mFluidTolerance( 0 ),
+	mFluidActiveTiles( true ),
+	mFluidActiveTileCount( 0 ),
+	mFluidMemoryKb( 0 ),
+	mParticleCount( 0 ),
+	mParticleMemoryKb( 0 ),
+	mParticleUpload( StreamingVbo::getModeName( StreamingVbo::MODE_NONE ) ),
+	mFluidCacheBlocking( false ),
+	mFluidIterationsUsed( 0 ),
+	mFluidChange( 0 ),
+	mSimulationThread( false ),
+	mFixedTimestep( true ),
+	mSimulationRate( 60.f ),
+	mMaxSubsteps( 4 ),
+	mSubsteps( 0 ),
 	mGameTimeline( Timeline::create() ),
 	mScreenshotThreadShouldQuit( false ),
 	mLastLogoEaseIn( -1.f )
@@ -368,6 +429,10 @@ void DynaApp::setup()
 	mParams.addText("Particles");
 	mParams.addPersistentParam("Particle min", &mParticleMin, mParticleMin, "min=0 max=50");
 	mParams.addPersistentParam("Particle max", &mParticleMax, mParticleMax, "min=0 max=50");
+	mParams.addPersistentParam("Particle capacity", &mParticleCapacity, mParticleCapacity,
+			"min=1024 max=262144 step=1024 help='most particles alive at once, the oldest are replaced beyond it'");
+	mParams.addPersistentParam("Stream particles", &mParticleStreaming, mParticleStreaming,
+			"help='the update writes the vertices into mapped buffer objects instead of client memory'");
 	mParams.addPersistentParam("Velocity max", &mMaxVelocity, mMaxVelocity, "min=1 max=100");
 	mParams.addPersistentParam("Velocity particle multiplier", &mVelParticleMult, mVelParticleMult, "min=0 max=2 step=.01");
 	mParams.addPersistentParam("Velocity particle min", &mVelParticleMin, mVelParticleMin, "min=1 max=100 step=.5");
@@ -402,24 +467,69 @@ void DynaApp::setup()
 	mParams.addPersistentParam("Pose duration", &mPoseDuration, mPoseDuration, "min=1. max=10 step=.5");
 	mParams.addPersistentParam("Game duration", &mGameDuration, mGameDuration, "min=10 max=200");
 
+	mParams.addSeparator();
+	mParams.addText("Fluid");
+	mParams.addPersistentParam("Fluid resolution", &mFluidPreset, mFluidPreset,
+			"min=0 max=3 help='grid width of 64, 96, 128 or 192 cells, where auto resolution starts'");
+	mParams.addPersistentParam("Auto resolution", &mFluidAutoResolution, mFluidAutoResolution,
+			"help='resize the grid between the presets to keep the solver within the budget'");
+	mParams.addPersistentParam("Solver budget (ms)", &mFluidBudget, mFluidBudget,
+			"min=1 max=33 step=.5 help='solver time per step auto resolution aims to stay within'");
+	mParams.addPersistentParam("Red-black solver", &mFluidRedBlack, mFluidRedBlack);
+	mParams.addPersistentParam("Multigrid projection", &mFluidMultigrid, mFluidMultigrid);
+	mParams.addPersistentParam("MacCormack advection", &mFluidMacCormack, mFluidMacCormack);
+	mParams.addPersistentParam("Fixed point color", &mFluidFixedColor, mFluidFixedColor);
+	mParams.addPersistentParam("Force radius", &mFluidForceRadius, mFluidForceRadius,
+			"min=0 max=0.2 step=0.005 help='fraction of the width the hand forces are spread over'");
+	mParams.addPersistentParam("Solver threads", &mFluidThreads, mFluidThreads,
+			"min=0 max=32 help='threads of the solver and the particles, 0 uses all cores'");
+	mParams.addPersistentParam("SIMD kernels", &mFluidSimd, mFluidSimd);
+	mParams.addPersistentParam("Solver tolerance", &mFluidTolerance, mFluidTolerance,
+			"min=0 max=.01 step=.000001 precision=6 help='stop solver iterations below this change, 0 always runs all iterations'");
+	mParams.addPersistentParam("Active tiles", &mFluidActiveTiles, mFluidActiveTiles,
+			"help='only update the parts of the fluid that are in motion'");
+	mParams.addPersistentParam("Cache blocking", &mFluidCacheBlocking, mFluidCacheBlocking,
+			"help='relax the red-black solver in bands of rows that stay in the cache, for large grids'");
+	mParams.addPersistentParam("Simulation thread", &mSimulationThread, mSimulationThread,
+			"help='step the fluid and particles in the background while drawing'");
+	mParams.addPersistentParam("Fixed timestep", &mFixedTimestep, mFixedTimestep,
+			"help='step the simulation at a constant rate independent of the frame rate'");
+	mParams.addPersistentParam("Simulation rate", &mSimulationRate, mSimulationRate,
+			"min=10 max=240 step=1 help='steps per second with fixed timestep'");
+	mParams.addPersistentParam("Max substeps", &mMaxSubsteps, mMaxSubsteps,
+			"min=1 max=16 help='steps per frame before the simulation slows down'");
+
 	mParams.addSeparator();
 	mParams.addText("Debug");
 	mParams.addParam("Fps", &mFps, "", true);
-
-	// fluid
-	mFluidSolver.setup( sFluidSizeX, sFluidSizeX );
-	mFluidSolver.enableRGB(false).setFadeSpeed(0.002).setDeltaT(.5).setVisc(0.00015).setColorDiffusion(0);
-	mFluidSolver.setWrap( false, true );
-	mFluidDrawer.setup( &mFluidSolver );
-
-	mParticles.setFluidSolver( &mFluidSolver );
+	mParams.addParam("Solver iterations", &mFluidIterationsUsed, "", true);
+	mParams.addParam("Solver change", &mFluidChange, "precision=6", true);
+	mParams.addParam("Substeps", &mSubsteps, "", true);
+	mParams.addParam("Active tiles", &mFluidActiveTileCount, "", true);
+	mParams.addParam("Fluid memory (KB)", &mFluidMemoryKb, "", true);
+	mParams.addParam("Particles", &mParticleCount, "", true);
+	mParams.addParam("Particle memory (KB)", &mParticleMemoryKb, "", true);
+	mParams.addParam("Particle upload", &mParticleUpload, "", true);
+	mParams.addParam("Fluid width", &mFluidSizeX, "", true);
+	mParams.addParam("Solver ms", &mFluidSolverMs, "precision=2", true);
 
 	gl::Fbo::Format format;
 	format.setWrap( GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE );
 
 	mFbo = gl::Fbo( 1024, 768, format );
-	mFluidSolver.setSize( sFluidSizeX, sFluidSizeX / mFbo.getAspectRatio() );
+
+	// fluid, sized for the fbo up front so the solver and the drawer only allocate once
+	mFluidQuality.setPreset( mFluidPreset );
+	mFluidSizeX = mFluidQuality.getWidth();
+	mFluidSolver.setup( mFluidSizeX, mFluidSizeX / mFbo.getAspectRatio() );
+	mFluidSolver.enableRGB(false).setFadeSpeed(0.002).setDeltaT(.5).setVisc(0.00015).setColorDiffusion(0);
+	mFluidSolver.setWrap( false, true );
+	// the density and speed stats are not used
+	mFluidSolver.enableStats( false );
 	mFluidDrawer.setup( &mFluidSolver );
+
+	mParticles.setFluidSolver( &mFluidSolver );
+	mSimulation.setup( &mFluidSolver, &mParticles );
 	mParticles.setWindowSize( mFbo.getSize() );
 
 	format.enableColorBuffer( true, 8 );
@@ -472,6 +582,7 @@ void DynaApp::setup()
 									  gameTimerGfxPath / "game-dot-1.png" );
 
 	Rand::randomize();
+	mParticles.setSeed( Rand::randUint() );
 
 	// gallery
 	// initialize directory names on first run
@@ -590,6 +701,8 @@ void DynaApp::shutdown()
 
 	mKinectThread.join();
 
+	mSimulation.enableThread( false );
+
 	mScreenshotThreadShouldQuit = true;
 	mScreenshotThread.join();
 }
@@ -680,7 +793,7 @@ void DynaApp::lostUser( mndl::ni::UserTracker::UserEvent event )
 void DynaApp::resize()
 {
 	/*
-	mFluidSolver.setSize( sFluidSizeX, sFluidSizeX / event.getAspectRatio() );
+	mFluidSolver.setSize( mFluidSizeX, mFluidSizeX / event.getAspectRatio() );
 	mFluidDrawer.setup( &mFluidSolver );
 	mParticles.setWindowSize( event.getSize() );
 	*/
@@ -780,11 +893,11 @@ void DynaApp::addToFluid( Vec2f pos, Vec2f vel, bool addParticles, bool addForce
 									 mParticleMin, mParticleMax ) );
 			if (count > 0)
 			{
-				mParticles.addParticle( pos * Vec2f( mFbo.getSize() ), count);
+				mSimulation.addParticles( pos * Vec2f( mFbo.getSize() ), count);
 			}
 		}
 		if ( addForce )
-			mFluidSolver.addForceAtPos( pos, vel * velocityMult );
+			mSimulation.addForce( pos, vel * velocityMult, mFluidForceRadius );
 	}
 }
 
@@ -1082,10 +1195,60 @@ void DynaApp::update()
 
 
 	// fluid & particles
-	mFluidSolver.update();
+	// the solver can only be changed between steps
+	mSimulation.sync();
+	mSimulation.enableThread( mSimulationThread );
+	mSimulation.setFixedTimestep( mFixedTimestep, mSimulationRate, mMaxSubsteps );
+	mFluidSolver.setSolverMethod( mFluidRedBlack ? ciMsaFluidSolver::SOLVER_RED_BLACK :
+			ciMsaFluidSolver::SOLVER_GAUSS_SEIDEL );
+	mFluidSolver.setProjectionMethod( mFluidMultigrid ? ciMsaFluidSolver::PROJECTION_MULTIGRID :
+			ciMsaFluidSolver::PROJECTION_RELAXATION );
+	mFluidSolver.setAdvectionMethod( mFluidMacCormack ? ciMsaFluidSolver::ADVECTION_MACCORMACK :
+			ciMsaFluidSolver::ADVECTION_SEMI_LAGRANGIAN );
+	mFluidSolver.enableFixedColor( mFluidFixedColor );
+	mFluidSolver.setNumThreads( mFluidThreads );
+	mParticles.setNumThreads( mFluidThreads );
+	mFluidSolver.enableSimd( mFluidSimd );
+	mFluidSolver.setSolverTolerance( mFluidTolerance );
+	mFluidSolver.enableActiveTiles( mFluidActiveTiles );
+	mFluidSolver.enableCacheBlocking( mFluidCacheBlocking );
+
+	// the grid follows the solver time of the last step with auto resolution,
+	// resampling the fluid keeps the change from showing. the substeps are still
+	// those of the last update, the step synced above, frames without a step
+	// would feed the same time again
+	mFluidSolverMs = float( mSimulation.getSolverSeconds() * 1000 );
+	if ( mFluidAutoResolution )
+	{
+		mFluidQuality.setBudget( mFluidBudget / 1000. );
+		if ( mSimulation.getNumSubsteps() > 0 )
+			mFluidQuality.update( mSimulation.getSolverSeconds() );
+		mFluidPreset = mFluidQuality.getPreset();
+	}
+	else
+	{
+		mFluidQuality.setPreset( mFluidPreset );
+	}
+	if ( mFluidQuality.getWidth() != mFluidSizeX )
+	{
+		mFluidSizeX = mFluidQuality.getWidth();
+		mFluidSolver.resize( mFluidSizeX, mFluidSizeX / mFbo.getAspectRatio() );
+		mFluidDrawer.setup( &mFluidSolver );
+	}
+	mFluidIterationsUsed = mFluidSolver.getSolverIterationsUsed();
+	mFluidChange = mFluidSolver.getSolverChange();
+	mFluidActiveTileCount = mFluidSolver.getNumActiveTiles();
+	mFluidMemoryKb = (int)( mFluidSolver.getMemoryUsage() / 1024 );
+
+	mParticles.setCapacity( mParticleCapacity );
+	mParticles.enableStreaming( mParticleStreaming );
+	mParticleUpload = StreamingVbo::getModeName( mParticles.getStreamingMode() );
+	mParticleCount = mParticles.getNumParticles();
+	mParticleMemoryKb = (int)( mParticles.getMemoryUsage() / 1024 );
 
 	mParticles.setAging( 0.9 );
-	mParticles.update( getElapsedSeconds() );
+	mSimulation.update( getElapsedSeconds() );
+	mSubsteps = mSimulation.getNumSubsteps();
 
 	// add new images saved from thread to gallery
 	{
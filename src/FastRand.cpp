@@ -0,0 +1,123 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cinder/CinderMath.h"
+
+#include "FastRand.h"
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+	#define FASTRAND_SSE2
+	#include <emmintrin.h>
+#endif
+
+using namespace ci;
+
+// finalizer of murmur3, spreads the seed over all the bits of the states
+static uint32_t mix( uint32_t h )
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+FastRand::FastRand( uint32_t seed )
+{
+	this->seed( seed );
+}
+
+void FastRand::seed( uint32_t seed )
+{
+	uint32_t h = seed;
+	for ( int i = 0; i < 4; i++ )
+	{
+		mX[ i ] = mix( h += 0x9e3779b9 );
+		mY[ i ] = mix( h += 0x9e3779b9 );
+		mZ[ i ] = mix( h += 0x9e3779b9 );
+		mW[ i ] = mix( h += 0x9e3779b9 );
+		// xorshift never leaves the all zero state
+		if ( ( mX[ i ] | mY[ i ] | mZ[ i ] | mW[ i ] ) == 0 )
+			mW[ i ] = 1;
+	}
+	mIndex = 4;
+}
+
+void FastRand::step()
+{
+	for ( int i = 0; i < 4; i++ )
+	{
+		uint32_t t = mX[ i ] ^ ( mX[ i ] << 11 );
+		mX[ i ] = mY[ i ];
+		mY[ i ] = mZ[ i ];
+		mZ[ i ] = mW[ i ];
+		mW[ i ] = mW[ i ] ^ ( mW[ i ] >> 19 ) ^ t ^ ( t >> 8 );
+		mBuffer[ i ] = mW[ i ];
+	}
+	mIndex = 0;
+}
+
+int FastRand::nextInt( int min, int max )
+{
+	if ( max <= min )
+		return min;
+	int i = min + (int)( nextFloat() * ( max - min ) );
+	return i < max ? i : max - 1;
+}
+
+Vec2f FastRand::nextVec2f()
+{
+	float angle = nextFloat() * 2 * (float)M_PI;
+	return Vec2f( math< float >::cos( angle ), math< float >::sin( angle ) );
+}
+
+void FastRand::nextFloats( float *floats, int n )
+{
+	int i = 0;
+	// what is left of the last step comes first, as it would one at a time
+	while ( i < n && mIndex < 4 )
+		floats[ i++ ] = toFloat( mBuffer[ mIndex++ ] );
+
+#if defined( FASTRAND_SSE2 )
+	if ( n - i >= 4 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i *)mX );
+		__m128i y = _mm_loadu_si128( (const __m128i *)mY );
+		__m128i z = _mm_loadu_si128( (const __m128i *)mZ );
+		__m128i w = _mm_loadu_si128( (const __m128i *)mW );
+		const __m128 scale = _mm_set1_ps( 1.0f / 16777216.0f );
+		for ( ; i + 4 <= n; i += 4 )
+		{
+			__m128i t = _mm_xor_si128( x, _mm_slli_epi32( x, 11 ) );
+			x = y;
+			y = z;
+			z = w;
+			w = _mm_xor_si128( _mm_xor_si128( w, _mm_srli_epi32( w, 19 ) ), _mm_xor_si128( t, _mm_srli_epi32( t, 8 ) ) );
+			// below 2^24 the conversion is exact, as in toFloat
+			_mm_storeu_ps( floats + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_srli_epi32( w, 8 ) ), scale ) );
+		}
+		_mm_storeu_si128( (__m128i *)mX, x );
+		_mm_storeu_si128( (__m128i *)mY, y );
+		_mm_storeu_si128( (__m128i *)mZ, z );
+		_mm_storeu_si128( (__m128i *)mW, w );
+	}
+#endif
+
+	while ( i < n )
+		floats[ i++ ] = nextFloat();
+}
@@ -0,0 +1,89 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cinder/CinderMath.h"
+
+#include "FluidQuality.h"
+
+using namespace ci;
+using namespace std;
+
+// weight of a new step in the average
+const double FluidQuality::sSmoothing = 0.1;
+// the next preset has to fit in this part of the budget, so the grid does not
+// bounce between two sizes when the budget falls between them
+const double FluidQuality::sHeadroom = 0.75;
+// steps averaged at a new size before it can change again
+const int FluidQuality::sSettleSamples = 30;
+
+FluidQuality::FluidQuality()
+	: mPreset( 0 ),
+	  mBudget( 0.008 ),
+	  mAverage( 0 ),
+	  mSamples( 0 )
+{
+	static const int widths[] = { 64, 96, 128, 192 };
+	setPresets( vector< int >( widths, widths + 4 ) );
+	setPreset( 2 );
+}
+
+void FluidQuality::setPresets( const vector< int > &widths )
+{
+	mPresets = widths;
+	if ( mPresets.empty() )
+		mPresets.push_back( 128 );
+	setPreset( mPreset );
+}
+
+void FluidQuality::setPreset( int index )
+{
+	index = math< int >::clamp( index, 0, getNumPresets() - 1 );
+	if ( index == mPreset )
+		return;
+	mPreset = index;
+	mAverage = 0;
+	mSamples = 0;
+}
+
+bool FluidQuality::update( double solverSeconds )
+{
+	// no step this frame
+	if ( solverSeconds <= 0 )
+		return false;
+
+	mAverage = ( mSamples == 0 ) ? solverSeconds : mAverage + ( solverSeconds - mAverage ) * sSmoothing;
+	if ( ++mSamples < sSettleSamples )
+		return false;
+
+	if ( mAverage > mBudget && mPreset > 0 )
+	{
+		setPreset( mPreset - 1 );
+		return true;
+	}
+
+	if ( mPreset + 1 < getNumPresets() )
+	{
+		// the cost follows the number of cells, the height scales with the width
+		double scale = double( mPresets[ mPreset + 1 ] ) / mPresets[ mPreset ];
+		if ( mAverage * scale * scale < mBudget * sHeadroom )
+		{
+			setPreset( mPreset + 1 );
+			return true;
+		}
+	}
+	return false;
+}
@@ -1,70 +1,133 @@
 #include "cinder/CinderMath.h"
 #include "cinder/app/app.h"
 #include "cinder/gl/gl.h"
-#include "cinder/Rand.h"
 
 #include "Particles.h"
 
 using namespace ci;
 using namespace std;
 
-const float Particle::sMomentum = 0.6f;
-const float Particle::sFluidForce = 0.9f;
+const float ParticleManager::sMomentum = 0.6f;
+const float ParticleManager::sFluidForce = 0.9f;
+float ParticleManager::sAging = 0.995f;
+
+ParticleManager::ParticleManager( int capacity )
+	: mSeed( 1 ),
+	  mCapacity( 0 ),
+	  mCurrent( 0 ),
+	  mCount( 0 ),
+	  mStore( 0 ),
+	  mStep( 0 ),
+	  mFront( 0 ),
+	  mInterpolation( 1 ),
+	  mStreamMode( StreamingVbo::MODE_NONE ),
+	  mStreamVertices( NULL )
+{
+	mActive[ 0 ] = mActive[ 1 ] = 0;
+	mStreamed[ 0 ] = mStreamed[ 1 ] = false;
+	setWindowSize( Vec2i( 1, 1 ) );
+	setCapacity( capacity );
+}
 
-Particle::Particle()
-	: mLifeSpan( 0 )
+// resizes v to n values, giving the memory back when it shrinks
+static void resizeBuffer( vector< float > &v, size_t n )
 {
+	if ( n < v.size() )
+		vector< float >( v.begin(), v.begin() + n ).swap( v );
+	else
+		v.resize( n );
 }
 
-Particle::Particle( const Vec2f &pos )
+void ParticleManager::Store::resize( int capacity )
 {
-	mPos = pos;
-	mVel = Vec2f( 0, 0 );
-	mSize = Rand::randFloat( 10, 20 );
-	mLifeSpan = Rand::randFloat( 0.3f, 1 );
-	mMass = Rand::randFloat( 0.1f, 1 );
+	resizeBuffer( mX, capacity );
+	resizeBuffer( mY, capacity );
+	resizeBuffer( mVx, capacity );
+	resizeBuffer( mVy, capacity );
+	resizeBuffer( mLife, capacity );
+	resizeBuffer( mMass, capacity );
 }
 
-void Particle::update( double time, const ciMsaFluidSolver *solver, const Vec2f &windowSize, const Vec2f &invWindowSize, float *positions, float *colors )
+void ParticleManager::setCapacity( int capacity )
 {
-	mVel = solver->getVelocityAtPos( mPos * invWindowSize ) * (mMass * sFluidForce ) * windowSize + mVel * sMomentum;
+	capacity = math< int >::max( capacity, 1 );
+	if ( capacity == mCapacity )
+		return;
 
-	//if ( mVel.lengthSquared() < 10 )
+	mCapacity = capacity;
+	mCount = math< int >::min( mCount, capacity );
+	mCurrent = 0;
+	for ( int i = 0; i < 2; i++ )
 	{
-		mVel += Rand::randVec2f() * 3.;
+		mStores[ i ].resize( capacity );
+
+		// the last update stays drawable up to the new capacity
+		mActive[ i ] = math< int >::min( mActive[ i ], capacity );
+		resizeBuffer( mPositions[ i ], capacity * 2 * 2 );
+		resizeBuffer( mPrevPositions[ i ], capacity * 2 );
+		resizeBuffer( mColors[ i ], capacity * 4 * 2 );
 	}
+	resizeBuffer( mDrawPositions, capacity * 2 * 2 );
+	resizeBuffer( mSampleX, capacity );
+	resizeBuffer( mSampleY, capacity );
+	resizeBuffer( mSampleU, capacity );
+	resizeBuffer( mSampleV, capacity );
 
-	mPos += mVel;
+	int chunks = ( capacity + PARTICLE_CHUNK - 1 ) / PARTICLE_CHUNK;
+	mChunkLive.assign( chunks, 0 );
+	mChunkOffset.assign( chunks, 0 );
 
-	mLifeSpan *= ParticleManager::getAging();
-	if ( mLifeSpan < 0.01f )
-		mLifeSpan = 0;
+	if ( mStreamMode != StreamingVbo::MODE_NONE )
+		setupStreaming();
+}
 
-	Vec2f velLimited = mVel.limited( 10 );
+void ParticleManager::enableStreaming( bool enable, StreamingVbo::Mode maxMode )
+{
+	StreamingVbo::Mode mode = enable ? maxMode : StreamingVbo::MODE_NONE;
+	if ( mode == mStreamMode )
+		return;
+	mStreamMode = mode;
+	setupStreaming();
+}
 
-	positions[0] = mPos.x - velLimited.x;
-	positions[1] = mPos.y - velLimited.y;
-	positions[2] = mPos.x;
-	positions[3] = mPos.y;
+void ParticleManager::setupStreaming()
+{
+	mStreamVertices = NULL;
+	mDrawVbo.clear();
+	mVbo.clear();
+	if ( mStreamMode != StreamingVbo::MODE_NONE &&
+		 mVbo.setup( mCapacity * ( 4 + 8 ) * sizeof( float ), mStreamMode ) != StreamingVbo::MODE_NONE )
+	{
+		mDrawVbo.setup( mCapacity * 4 * sizeof( float ), mVbo.getMode() );
+		mStreamVertices = (float *)mVbo.map();
+	}
 
-	float col = Rand::randFloat();
-	colors[0] = col;
-	colors[1] = col;
-	colors[2] = col;
-	colors[3] = mLifeSpan;
-	colors[4] = col;
-	colors[5] = col;
-	colors[6] = col;
-	colors[7] = mLifeSpan;
+	// the vertices drawn last were in the old ring or only partly in client memory
+	mActive[ mFront ] = 0;
+	mStreamed[ mFront ] = false;
 }
 
-float ParticleManager::sAging = 0.995f;
+size_t ParticleManager::getMemoryUsage() const
+{
+	size_t floats = mDrawPositions.capacity() + mSampleX.capacity() + mSampleY.capacity() +
+		mSampleU.capacity() + mSampleV.capacity();
+	for ( int i = 0; i < 2; i++ )
+	{
+		const Store &s = mStores[ i ];
+		floats += s.mX.capacity() + s.mY.capacity() + s.mVx.capacity() + s.mVy.capacity() +
+			s.mLife.capacity() + s.mMass.capacity();
+		floats += mPositions[ i ].capacity() + mPrevPositions[ i ].capacity() + mColors[ i ].capacity();
+	}
+	return sizeof( *this ) + floats * sizeof( float ) +
+		( mChunkLive.capacity() + mChunkOffset.capacity() ) * sizeof( int ) +
+		mVbo.getMemoryUsage() + mDrawVbo.getMemoryUsage();
+}
 
-ParticleManager::ParticleManager()
-	: mCurrent( 0 ),
-	  mActive( 0 )
+void ParticleManager::setSeed( uint32_t seed )
 {
-	setWindowSize( Vec2i( 1, 1 ) );
+	mSeed = seed;
+	mStep = 0;
+	mRand.seed( seed );
 }
 
 void ParticleManager::setWindowSize( Vec2i winSize )
@@ -75,20 +138,181 @@ void ParticleManager::setWindowSize( Vec2i winSize )
 
 void ParticleManager::update( double seconds )
 {
-	int j = 0;
-	mActive = 0;
-	for ( int i = 0; i < MAX_PARTICLES; i++ )
+	ciMsaFluidDenormalGuard denormals;
+
+	int back = 1 - mFront;
+	int chunks = ( mCount + PARTICLE_CHUNK - 1 ) / PARTICLE_CHUNK;
+
+	mThreadPool.parallelFor( 0, chunks, [ this ]( int c0, int c1 )
+	{
+		for ( int c = c0; c < c1; c++ )
+			mChunkLive[ c ] = moveChunk( c );
+	} );
+
+	// each chunk packs its survivors after those of the chunks before it
+	int count = 0;
+	for ( int c = 0; c < chunks; c++ )
+	{
+		mChunkOffset[ c ] = count;
+		count += mChunkLive[ c ];
+	}
+
+	mThreadPool.parallelFor( 0, chunks, [ this, back ]( int c0, int c1 )
+	{
+		for ( int c = c0; c < c1; c++ )
+			packChunk( c, mChunkOffset[ c ], back );
+	} );
+
+	mStore = 1 - mStore;
+	mCount = count;
+	mActive[ back ] = count;
+	mStreamed[ back ] = mStreamVertices != NULL;
+	mStep++;
+}
+
+uint32_t ParticleManager::chunkSeed( int c, int pass ) const
+{
+	return mSeed ^ ( ( mStep << 16 ) + c * 2 + pass ) * 0x9e3779b9;
+}
+
+int ParticleManager::moveChunk( int c )
+{
+	Store &s = mStores[ mStore ];
+	int begin = c * PARTICLE_CHUNK;
+	int end = math< int >::min( begin + PARTICLE_CHUNK, mCount );
+	FastRand rand( chunkSeed( c, 0 ) );
+
+	for ( int i = begin; i < end; i++ )
+	{
+		mSampleX[ i ] = s.mX[ i ] * mInvWindowSize.x;
+		mSampleY[ i ] = s.mY[ i ] * mInvWindowSize.y;
+	}
+	mSolver->getVelocityAtPositions( &mSampleX[ begin ], &mSampleY[ begin ], &mSampleU[ begin ], &mSampleV[ begin ], end - begin );
+
+	// the sampled positions are done with, their place takes the angles of the random kicks
+	float *angles = mSampleX.data();
+	rand.nextFloats( angles + begin, end - begin );
+
+	float forceX = sFluidForce * mWindowSize.x;
+	float forceY = sFluidForce * mWindowSize.y;
+	for ( int i = begin; i < end; i++ )
+	{
+		float angle = angles[ i ] * 2 * (float)M_PI;
+		s.mVx[ i ] = mSampleU[ i ] * s.mMass[ i ] * forceX + s.mVx[ i ] * sMomentum + math< float >::cos( angle ) * 3.f;
+		s.mVy[ i ] = mSampleV[ i ] * s.mMass[ i ] * forceY + s.mVy[ i ] * sMomentum + math< float >::sin( angle ) * 3.f;
+		s.mX[ i ] += s.mVx[ i ];
+		s.mY[ i ] += s.mVy[ i ];
+	}
+
+	int live = 0;
+	for ( int i = begin; i < end; i++ )
+	{
+		s.mLife[ i ] *= sAging;
+		if ( s.mLife[ i ] < 0.01f )
+			s.mLife[ i ] = 0;
+		else
+			live++;
+	}
+	return live;
+}
+
+void ParticleManager::packChunk( int c, int offset, int back )
+{
+	const Store &s = mStores[ mStore ];
+	Store &d = mStores[ 1 - mStore ];
+	int begin = c * PARTICLE_CHUNK;
+	int end = math< int >::min( begin + PARTICLE_CHUNK, mCount );
+	FastRand rand( chunkSeed( c, 1 ) );
+
+	// the particles that died this step are dropped right away
+	int k = offset;
+	for ( int i = begin; i < end; i++ )
 	{
-		if ( mParticles[i].isAlive() )
+		if ( s.mLife[ i ] > 0 )
 		{
-			mParticles[i].update( seconds, mSolver,
-					mWindowSize, mInvWindowSize,
-					&mPositions[j * 2],
-					&mColors[j * 4]);
-			j += 2;
-			mActive++;
+			d.mX[ k ] = s.mX[ i ];
+			d.mY[ k ] = s.mY[ i ];
+			d.mVx[ k ] = s.mVx[ i ];
+			d.mVy[ k ] = s.mVy[ i ];
+			d.mLife[ k ] = s.mLife[ i ];
+			d.mMass[ k ] = s.mMass[ i ];
+			k++;
 		}
 	}
+
+	// the gray levels go where the chunk sampled the fluid, its survivors fit in that range
+	float *grays = mSampleY.data() + begin - offset;
+	rand.nextFloats( grays + offset, k - offset );
+
+	float *positions = mPositions[ back ].data();
+	float *prevPositions = mPrevPositions[ back ].data();
+	float *streamPositions = mStreamVertices ? mStreamVertices : positions;
+	float *colors = mStreamVertices ? mStreamVertices + mCapacity * 4 : mColors[ back ].data();
+	for ( int i = offset; i < k; i++ )
+	{
+		// the tail is the velocity limited to 10 pixels
+		float tailX = d.mVx[ i ];
+		float tailY = d.mVy[ i ];
+		float lengthSq = tailX * tailX + tailY * tailY;
+		if ( lengthSq > 100.f )
+		{
+			float scale = 10.f / math< float >::sqrt( lengthSq );
+			tailX *= scale;
+			tailY *= scale;
+		}
+
+		float *p = &positions[ i * 4 ];
+		p[0] = d.mX[ i ] - tailX;
+		p[1] = d.mY[ i ] - tailY;
+		p[2] = d.mX[ i ];
+		p[3] = d.mY[ i ];
+		float *q = &streamPositions[ i * 4 ];
+		q[0] = p[0];
+		q[1] = p[1];
+		q[2] = p[2];
+		q[3] = p[3];
+		prevPositions[ i * 2 ] = d.mX[ i ] - d.mVx[ i ];
+		prevPositions[ i * 2 + 1 ] = d.mY[ i ] - d.mVy[ i ];
+
+		float col = grays[ i ];
+		float *col4 = &colors[ i * 8 ];
+		col4[0] = col4[1] = col4[2] = col;
+		col4[3] = d.mLife[ i ];
+		col4[4] = col4[5] = col4[6] = col;
+		col4[7] = d.mLife[ i ];
+	}
+}
+
+void ParticleManager::swapBuffers()
+{
+	mFront = 1 - mFront;
+
+	if ( mStreamVertices )
+	{
+		// the slot the update wrote is drawn from now on, the next update writes the one after it
+		if ( !mVbo.unmap() )
+			mActive[ mFront ] = 0;
+		mStreamVertices = (float *)mVbo.map();
+	}
+}
+
+void ParticleManager::interpolate( float *positions ) const
+{
+	// moves both ends of the line back towards the previous position
+	const float *current = mPositions[ mFront ].data();
+	const float *prev = mPrevPositions[ mFront ].data();
+	float t = 1 - mInterpolation;
+	for ( int i = 0; i < mActive[ mFront ]; i++ )
+	{
+		const float *p = &current[ i * 4 ];
+		float dx = ( prev[ i * 2 ] - p[2] ) * t;
+		float dy = ( prev[ i * 2 + 1 ] - p[3] ) * t;
+		float *d = &positions[ i * 4 ];
+		d[0] = p[0] + dx;
+		d[1] = p[1] + dy;
+		d[2] = p[2] + dx;
+		d[3] = p[3] + dy;
+	}
 }
 
 void ParticleManager::draw()
@@ -97,12 +321,49 @@ void ParticleManager::draw()
 	gl::enable( GL_LINE_SMOOTH );
 
 	glEnableClientState( GL_VERTEX_ARRAY );
-	glVertexPointer( 2, GL_FLOAT, 0, mPositions );
-
 	glEnableClientState( GL_COLOR_ARRAY );
-	glColorPointer( 4, GL_FLOAT, 0, mColors );
 
-	glDrawArrays( GL_LINES, 0, mActive * 2 );
+	bool interpolated = false;
+	if ( mStreamed[ mFront ] )
+	{
+		// the pointers are offsets into the slot the update wrote
+		size_t offset = mVbo.bind();
+		glVertexPointer( 2, GL_FLOAT, 0, (const GLvoid *)offset );
+		glColorPointer( 4, GL_FLOAT, 0, (const GLvoid *)( offset + mCapacity * 4 * sizeof( float ) ) );
+		mVbo.unbind();
+
+		float *positions = ( mInterpolation < 1 ) ? (float *)mDrawVbo.map() : NULL;
+		if ( positions )
+		{
+			interpolate( positions );
+			interpolated = mDrawVbo.unmap();
+			if ( interpolated )
+			{
+				glVertexPointer( 2, GL_FLOAT, 0, (const GLvoid *)mDrawVbo.bind() );
+				mDrawVbo.unbind();
+			}
+		}
+	}
+	else
+	{
+		const float *positions = mPositions[ mFront ].data();
+		if ( mInterpolation < 1 )
+		{
+			interpolate( mDrawPositions.data() );
+			positions = mDrawPositions.data();
+		}
+		glVertexPointer( 2, GL_FLOAT, 0, positions );
+		glColorPointer( 4, GL_FLOAT, 0, mColors[ mFront ].data() );
+	}
+
+	glDrawArrays( GL_LINES, 0, mActive[ mFront ] * 2 );
+
+	if ( mStreamed[ mFront ] )
+	{
+		mVbo.fence();
+		if ( interpolated )
+			mDrawVbo.fence();
+	}
 
 	glDisableClientState( GL_VERTEX_ARRAY );
 	glDisableClientState( GL_COLOR_ARRAY );
@@ -110,12 +371,28 @@ void ParticleManager::draw()
 
 void ParticleManager::addParticle( const Vec2f &pos, int count /* = 1 */ )
 {
-	mParticles[ mCurrent ] = Particle( pos );
-	for (int i = count - 1; i > 0; i--)
+	for ( int n = 0; n < count; n++ )
 	{
-		mCurrent = (mCurrent + 1) & (MAX_PARTICLES - 1);
-		mParticles[ mCurrent ] = Particle( pos + Rand::randVec2f() * 10 );
+		int i;
+		if ( mCount < mCapacity )
+		{
+			i = mCount++;
+		}
+		else
+		{
+			// all alive, replaces them in turn
+			i = mCurrent;
+			if ( ++mCurrent == mCapacity )
+				mCurrent = 0;
+		}
+
+		Store &s = mStores[ mStore ];
+		Vec2f p = ( n == 0 ) ? pos : pos + mRand.nextVec2f() * 10;
+		s.mX[ i ] = p.x;
+		s.mY[ i ] = p.y;
+		s.mVx[ i ] = 0;
+		s.mVy[ i ] = 0;
+		s.mLife[ i ] = mRand.nextFloat( 0.3f, 1 );
+		s.mMass[ i ] = mRand.nextFloat( 0.1f, 1 );
 	}
-	mCurrent = (mCurrent + 1) & (MAX_PARTICLES - 1);
 }
-
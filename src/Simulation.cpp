@@ -0,0 +1,213 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cinder/CinderMath.h"
+#include "cinder/Timer.h"
+
+#include "Simulation.h"
+
+using namespace ci;
+using namespace std;
+
+Simulation::Simulation()
+	: mSolver( NULL ),
+	  mParticles( NULL ),
+	  mStepPending( false ),
+	  mStepDone( false ),
+	  mThreadShouldQuit( false ),
+	  mStepSeconds( 0 ),
+	  mStepCount( 0 ),
+	  mStepAlpha( 1 ),
+	  mFixedTimestep( false ),
+	  mStepDuration( 1. / 60. ),
+	  mMaxSubsteps( 4 ),
+	  mNumSubsteps( 0 ),
+	  mSolverSeconds( 0 ),
+	  mAccumulator( 0 ),
+	  mLastSeconds( -1 )
+{
+}
+
+Simulation::~Simulation()
+{
+	enableThread( false );
+}
+
+void Simulation::setup( ciMsaFluidSolver *solver, ParticleManager *particles )
+{
+	enableThread( false );
+	mSolver = solver;
+	mParticles = particles;
+}
+
+void Simulation::enableThread( bool enable )
+{
+	if ( enable == isThreaded() )
+		return;
+
+	if ( enable )
+	{
+		mStepPending = false;
+		mStepDone = false;
+		mThreadShouldQuit = false;
+		mThread = thread( bind( &Simulation::threadFn, this ) );
+	}
+	else
+	{
+		sync();
+		{
+			lock_guard< mutex > lock( mStepMutex );
+			mThreadShouldQuit = true;
+		}
+		mStepCond.notify_all();
+		mThread.join();
+	}
+}
+
+void Simulation::setFixedTimestep( bool enable, double rate /* = 60. */, int maxSubsteps /* = 4 */ )
+{
+	if ( enable != mFixedTimestep )
+		mAccumulator = 0;
+	mFixedTimestep = enable;
+	mStepDuration = 1. / math< double >::max( rate, 1. );
+	mMaxSubsteps = math< int >::max( maxSubsteps, 1 );
+}
+
+void Simulation::addForce( const Vec2f &pos, const Vec2f &force, float radius /* = 0 */ )
+{
+	// the solver queues splats itself and adds them at the start of its next update
+	ciMsaFluidSolver::Splat splat = { pos, force, Color::black(), radius };
+	mSolver->addSplat( splat );
+}
+
+void Simulation::addParticles( const Vec2f &pos, int count )
+{
+	lock_guard< mutex > lock( mQueueMutex );
+	Emitter e = { pos, count };
+	mEmitters.push_back( e );
+}
+
+void Simulation::sync()
+{
+	if ( !isThreaded() )
+		return;
+
+	unique_lock< mutex > lock( mStepMutex );
+	while ( mStepPending )
+		mStepCond.wait( lock );
+
+	if ( mStepDone )
+	{
+		mParticles->swapBuffers();
+		mParticles->setInterpolation( mStepAlpha );
+		mStepDone = false;
+	}
+}
+
+void Simulation::update( double seconds )
+{
+	double elapsed = ( mLastSeconds < 0 ) ? 0 : seconds - mLastSeconds;
+	mLastSeconds = seconds;
+
+	int steps = 1;
+	float alpha = 1;
+	if ( mFixedTimestep )
+	{
+		mAccumulator += math< double >::max( elapsed, 0 );
+		steps = int( mAccumulator / mStepDuration );
+		if ( steps > mMaxSubsteps )
+		{
+			// falling behind, slow the simulation down instead of spiralling
+			steps = mMaxSubsteps;
+			mAccumulator = steps * mStepDuration;
+		}
+		mAccumulator -= steps * mStepDuration;
+		alpha = float( mAccumulator / mStepDuration );
+	}
+	mNumSubsteps = steps;
+
+	if ( !isThreaded() )
+	{
+		if ( steps > 0 )
+		{
+			step( seconds, steps );
+			mParticles->swapBuffers();
+		}
+		mParticles->setInterpolation( alpha );
+		return;
+	}
+
+	sync();
+	if ( steps == 0 )
+	{
+		// nothing in flight, the drawn particles are the latest ones
+		mParticles->setInterpolation( alpha );
+		return;
+	}
+
+	{
+		lock_guard< mutex > lock( mStepMutex );
+		mStepSeconds = seconds;
+		mStepCount = steps;
+		mStepAlpha = alpha;
+		mStepPending = true;
+	}
+	mStepCond.notify_all();
+}
+
+void Simulation::step( double seconds, int steps )
+{
+	vector< Emitter > emitters;
+	{
+		lock_guard< mutex > lock( mQueueMutex );
+		emitters.swap( mEmitters );
+	}
+
+	// input is applied once, to the first of the substeps
+	for ( vector< Emitter >::const_iterator it = emitters.begin(); it != emitters.end(); ++it )
+		mParticles->addParticle( it->mPos, it->mCount );
+
+	double solverSeconds = 0;
+	for ( int i = 0; i < steps; i++ )
+	{
+		Timer timer( true );
+		mSolver->update();
+		solverSeconds += timer.getSeconds();
+		mParticles->update( seconds );
+	}
+	mSolverSeconds = solverSeconds / steps;
+}
+
+void Simulation::threadFn()
+{
+	unique_lock< mutex > lock( mStepMutex );
+	for (;;)
+	{
+		while ( !mStepPending && !mThreadShouldQuit )
+			mStepCond.wait( lock );
+		if ( mThreadShouldQuit )
+			return;
+
+		lock.unlock();
+		step( mStepSeconds, mStepCount );
+		lock.lock();
+
+		mStepPending = false;
+		mStepDone = true;
+		mStepCond.notify_all();
+	}
+}
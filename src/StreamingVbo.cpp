@@ -0,0 +1,231 @@
+/*
+ Copyright (C) 2012-2013 Gabor Papp
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+
+#include "StreamingVbo.h"
+
+using namespace ci;
+
+// the headers of older GLs do not know about buffer storage or fences
+#if defined( GL_MAP_PERSISTENT_BIT ) && defined( GL_SYNC_GPU_COMMANDS_COMPLETE )
+	#define STREAMINGVBO_PERSISTENT
+#endif
+#if defined( GL_MAP_INVALIDATE_BUFFER_BIT )
+	#define STREAMINGVBO_MAP_RANGE
+#endif
+
+static bool hasVersion( int major, int minor )
+{
+	const char *version = (const char *)glGetString( GL_VERSION );
+	int glMajor = 0, glMinor = 0;
+	if ( !version || sscanf( version, "%d.%d", &glMajor, &glMinor ) != 2 )
+		return false;
+	return glMajor > major || ( glMajor == major && glMinor >= minor );
+}
+
+StreamingVbo::StreamingVbo()
+	: mMode( MODE_NONE ),
+	  mSlotBytes( 0 ),
+	  mPersistent( NULL ),
+	  mMapRange( false ),
+	  mMapped( -1 ),
+	  mDrawn( -1 )
+{
+	for ( int i = 0; i < sNumSlots; i++ )
+	{
+		mBuffers[ i ] = 0;
+		mFences[ i ] = NULL;
+	}
+}
+
+StreamingVbo::~StreamingVbo()
+{
+	clear();
+}
+
+const char *StreamingVbo::getModeName( Mode mode )
+{
+	static const char *names[] = { "client arrays", "orphaned", "persistent" };
+	return names[ mode ];
+}
+
+StreamingVbo::Mode StreamingVbo::setup( size_t slotBytes, Mode maxMode )
+{
+	clear();
+	mSlotBytes = slotBytes;
+
+	if ( maxMode == MODE_NONE || slotBytes == 0 ||
+		 !( hasVersion( 1, 5 ) || gl::isExtensionAvailable( "GL_ARB_vertex_buffer_object" ) ) )
+		return mMode;
+
+#if defined( STREAMINGVBO_PERSISTENT )
+	if ( maxMode == MODE_PERSISTENT &&
+		 ( hasVersion( 4, 4 ) || gl::isExtensionAvailable( "GL_ARB_buffer_storage" ) ) &&
+		 ( hasVersion( 3, 2 ) || gl::isExtensionAvailable( "GL_ARB_sync" ) ) )
+	{
+		// coherent, so what the update writes is seen by the next draw without a flush
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers( 1, mBuffers );
+		glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ 0 ] );
+		glBufferStorage( GL_ARRAY_BUFFER, sNumSlots * slotBytes, NULL, flags );
+		mPersistent = (char *)glMapBufferRange( GL_ARRAY_BUFFER, 0, sNumSlots * slotBytes, flags );
+		glBindBuffer( GL_ARRAY_BUFFER, 0 );
+		if ( mPersistent )
+		{
+			mMode = MODE_PERSISTENT;
+			return mMode;
+		}
+		glDeleteBuffers( 1, mBuffers );
+		mBuffers[ 0 ] = 0;
+	}
+#endif
+
+#if defined( STREAMINGVBO_MAP_RANGE )
+	mMapRange = hasVersion( 3, 0 ) || gl::isExtensionAvailable( "GL_ARB_map_buffer_range" );
+#endif
+	glGenBuffers( sNumSlots, mBuffers );
+	for ( int i = 0; i < sNumSlots; i++ )
+	{
+		glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ i ] );
+		glBufferData( GL_ARRAY_BUFFER, slotBytes, NULL, GL_STREAM_DRAW );
+	}
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	mMode = MODE_ORPHAN;
+	return mMode;
+}
+
+void StreamingVbo::clear()
+{
+	if ( mMode == MODE_NONE )
+		return;
+
+#if defined( STREAMINGVBO_PERSISTENT )
+	for ( int i = 0; i < sNumSlots; i++ )
+	{
+		if ( mFences[ i ] )
+			glDeleteSync( (GLsync)mFences[ i ] );
+		mFences[ i ] = NULL;
+	}
+#endif
+	if ( mPersistent || mMapped >= 0 )
+	{
+		glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ mPersistent ? 0 : mMapped ] );
+		glUnmapBuffer( GL_ARRAY_BUFFER );
+		glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	}
+	glDeleteBuffers( mPersistent ? 1 : sNumSlots, mBuffers );
+	for ( int i = 0; i < sNumSlots; i++ )
+		mBuffers[ i ] = 0;
+
+	mMode = MODE_NONE;
+	mPersistent = NULL;
+	mMapped = -1;
+	mDrawn = -1;
+}
+
+void *StreamingVbo::map()
+{
+	if ( mMode == MODE_NONE )
+		return NULL;
+
+	// the slot after the one drawn was last drawn two unmaps ago
+	int slot = ( mDrawn + 1 ) % sNumSlots;
+	mMapped = slot;
+
+#if defined( STREAMINGVBO_PERSISTENT )
+	if ( mMode == MODE_PERSISTENT )
+	{
+		GLsync fence = (GLsync)mFences[ slot ];
+		if ( fence )
+		{
+			GLenum result;
+			do
+			{
+				result = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 );
+			} while ( result == GL_TIMEOUT_EXPIRED );
+			glDeleteSync( fence );
+			mFences[ slot ] = NULL;
+		}
+		return mPersistent + slot * mSlotBytes;
+	}
+#endif
+
+	// orphaning hands the old storage to the GPU and gets fresh memory without waiting for it
+	void *ptr;
+	glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ slot ] );
+	glBufferData( GL_ARRAY_BUFFER, mSlotBytes, NULL, GL_STREAM_DRAW );
+#if defined( STREAMINGVBO_MAP_RANGE )
+	if ( mMapRange )
+		ptr = glMapBufferRange( GL_ARRAY_BUFFER, 0, mSlotBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+	else
+#endif
+		ptr = glMapBuffer( GL_ARRAY_BUFFER, GL_WRITE_ONLY );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	if ( !ptr )
+		mMapped = -1;
+	return ptr;
+}
+
+bool StreamingVbo::unmap()
+{
+	if ( mMapped < 0 )
+		return false;
+
+	bool intact = true;
+	if ( mMode == MODE_ORPHAN )
+	{
+		glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ mMapped ] );
+		intact = glUnmapBuffer( GL_ARRAY_BUFFER ) == GL_TRUE;
+		glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	}
+	mDrawn = mMapped;
+	mMapped = -1;
+	return intact;
+}
+
+size_t StreamingVbo::bind()
+{
+	if ( mDrawn < 0 )
+		return 0;
+
+	if ( mMode == MODE_PERSISTENT )
+	{
+		glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ 0 ] );
+		return mDrawn * mSlotBytes;
+	}
+	glBindBuffer( GL_ARRAY_BUFFER, mBuffers[ mDrawn ] );
+	return 0;
+}
+
+void StreamingVbo::unbind()
+{
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+void StreamingVbo::fence()
+{
+#if defined( STREAMINGVBO_PERSISTENT )
+	// only the persistent slots need it, an orphaned slot gets fresh storage
+	if ( mMode == MODE_PERSISTENT && mDrawn >= 0 )
+	{
+		if ( mFences[ mDrawn ] )
+			glDeleteSync( (GLsync)mFences[ mDrawn ] );
+		mFences[ mDrawn ] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	}
+#endif
+}